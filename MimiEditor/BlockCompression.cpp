@@ -0,0 +1,266 @@
+#include "BlockCompression.h"
+
+namespace
+{
+	const std::size_t MinMatch = 4;
+	const std::size_t LastLiterals = 5; //The last 5 bytes are always literals.
+	const std::size_t MatchLimit = 12; //A match can't start in the last 12 bytes.
+	const std::size_t MaxOffset = 0xFFFF;
+	const std::size_t HashLog = 12;
+
+	inline std::uint32_t Read32(const std::uint8_t* p)
+	{
+		std::uint32_t ret;
+		std::memcpy(&ret, p, 4);
+		return ret;
+	}
+
+	inline std::size_t Hash(std::uint32_t seq)
+	{
+		return (seq * 2654435761u) >> (32 - HashLog);
+	}
+
+	//Write the length in the LZ4 way (255, 255, ..., rest).
+	inline bool WriteLength(std::uint8_t*& dest, std::uint8_t* destEnd, std::size_t len)
+	{
+		while (len >= 255)
+		{
+			if (dest == destEnd) return false;
+			*dest++ = 255;
+			len -= 255;
+		}
+		if (dest == destEnd) return false;
+		*dest++ = static_cast<std::uint8_t>(len);
+		return true;
+	}
+
+	inline bool ReadLength(const std::uint8_t*& src, const std::uint8_t* srcEnd, std::size_t& len)
+	{
+		std::uint8_t b;
+		do
+		{
+			if (src == srcEnd) return false;
+			b = *src++;
+			len += b;
+		} while (b == 255);
+		return true;
+	}
+
+	bool WriteSequence(std::uint8_t*& dest, std::uint8_t* destEnd,
+		const std::uint8_t* literal, std::size_t literalLen,
+		std::size_t offset, std::size_t matchLen)
+	{
+		if (dest == destEnd) return false;
+		std::uint8_t* token = dest++;
+		std::size_t matchCode = matchLen ? matchLen - MinMatch : 0;
+		*token = static_cast<std::uint8_t>(
+			((literalLen < 15 ? literalLen : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+		if (literalLen >= 15 && !WriteLength(dest, destEnd, literalLen - 15)) return false;
+		if (static_cast<std::size_t>(destEnd - dest) < literalLen) return false;
+		if (literalLen > 0)
+		{
+			std::memcpy(dest, literal, literalLen);
+			dest += literalLen;
+		}
+		if (matchLen == 0) return true; //Last sequence.
+		if (destEnd - dest < 2) return false;
+		*dest++ = static_cast<std::uint8_t>(offset);
+		*dest++ = static_cast<std::uint8_t>(offset >> 8);
+		if (matchCode >= 15 && !WriteLength(dest, destEnd, matchCode - 15)) return false;
+		return true;
+	}
+}
+
+std::size_t Mimi::BlockCompression::Compress(const std::uint8_t* src, std::size_t srcLen,
+	std::uint8_t* dest, std::size_t destLen)
+{
+	std::uint32_t table[1 << HashLog] = {}; //Position + 1, 0 for empty.
+	std::uint8_t* d = dest;
+	std::uint8_t* destEnd = dest + destLen;
+	std::size_t anchor = 0;
+
+	if (srcLen >= MatchLimit + 1)
+	{
+		const std::size_t limit = srcLen - MatchLimit;
+		std::size_t ip = 0;
+		while (ip < limit)
+		{
+			std::uint32_t seq = Read32(&src[ip]);
+			std::size_t h = Hash(seq);
+			std::size_t ref = table[h];
+			table[h] = static_cast<std::uint32_t>(ip + 1);
+			if (ref == 0 || ip - (ref - 1) > MaxOffset || Read32(&src[ref - 1]) != seq)
+			{
+				ip += 1;
+				continue;
+			}
+			ref -= 1;
+
+			std::size_t len = MinMatch;
+			const std::size_t maxLen = srcLen - LastLiterals - ip;
+			while (len < maxLen && src[ref + len] == src[ip + len])
+			{
+				len += 1;
+			}
+			if (!WriteSequence(d, destEnd, &src[anchor], ip - anchor, ip - ref, len))
+			{
+				return 0;
+			}
+			ip += len;
+			anchor = ip;
+		}
+	}
+	if (!WriteSequence(d, destEnd, &src[anchor], srcLen - anchor, 0, 0))
+	{
+		return 0;
+	}
+	return d - dest;
+}
+
+bool Mimi::BlockCompression::Decompress(const std::uint8_t* src, std::size_t srcLen,
+	std::uint8_t* dest, std::size_t destLen)
+{
+	const std::uint8_t* s = src;
+	const std::uint8_t* srcEnd = src + srcLen;
+	std::size_t op = 0;
+
+	while (s < srcEnd)
+	{
+		std::uint8_t token = *s++;
+
+		std::size_t literalLen = token >> 4;
+		if (literalLen == 15 && !ReadLength(s, srcEnd, literalLen)) return false;
+		if (static_cast<std::size_t>(srcEnd - s) < literalLen) return false;
+		if (destLen - op < literalLen) return false;
+		if (literalLen > 0)
+		{
+			std::memcpy(&dest[op], s, literalLen);
+			s += literalLen;
+			op += literalLen;
+		}
+
+		if (s == srcEnd) break; //Last sequence has no match.
+
+		if (srcEnd - s < 2) return false;
+		std::size_t offset = s[0] | (s[1] << 8);
+		s += 2;
+		std::size_t matchLen = token & 15;
+		if (matchLen == 15 && !ReadLength(s, srcEnd, matchLen)) return false;
+		matchLen += MinMatch;
+		if (offset == 0 || offset > op) return false;
+		if (destLen - op < matchLen) return false;
+
+		//Byte by byte, as the match may overlap with itself.
+		std::size_t from = op - offset;
+		for (std::size_t i = 0; i < matchLen; ++i)
+		{
+			dest[op + i] = dest[from + i];
+		}
+		op += matchLen;
+	}
+	return op == destLen;
+}
+
+Mimi::StaticBuffer Mimi::BlockCompression::MakeBlock(const std::uint8_t* src, std::size_t len)
+{
+	assert(len <= MaxBlockSize);
+	std::uint8_t temp[MaxBlockSize];
+	std::size_t maxSize = len / 4 * 3;
+	std::size_t size = Compress(src, len, temp, maxSize);
+
+	StaticBuffer ret;
+	if (size == 0)
+	{
+		ret.Clear();
+		return ret;
+	}
+	StaticBuffer::StaticBufferData* data = StaticBuffer::AllocateData(size + 2);
+	data->RawData[0] = static_cast<std::uint8_t>(len);
+	data->RawData[1] = static_cast<std::uint8_t>(len >> 8);
+	std::memcpy(&data->RawData[2], temp, size);
+	ret.Data = data;
+	return ret;
+}
+
+std::size_t Mimi::BlockCompression::GetDecodedSize(StaticBuffer block)
+{
+	const std::uint8_t* data = block.GetRawData();
+	return data[0] | (data[1] << 8);
+}
+
+Mimi::StaticBuffer Mimi::BlockCompression::DecodeBlock(StaticBuffer block)
+{
+	std::size_t len = GetDecodedSize(block);
+	StaticBuffer::StaticBufferData* data = StaticBuffer::AllocateData(len);
+	bool success = Decompress(&block.GetRawData()[2], block.GetSize() - 2, data->RawData, len);
+	assert(success && "BlockCompression: corrupted block.");
+	(void)success;
+
+	StaticBuffer ret;
+	ret.Data = data;
+	return ret;
+}
+
+Mimi::DecodedBlockCache::DecodedBlockCache()
+{
+	for (auto&& e : Entries)
+	{
+		e.Block.Clear();
+		e.Decoded.Clear();
+		e.LastUse = 0;
+	}
+	UseCount = 0;
+}
+
+Mimi::DecodedBlockCache::~DecodedBlockCache()
+{
+	Clear();
+}
+
+const std::uint8_t* Mimi::DecodedBlockCache::Get(StaticBuffer block)
+{
+	UseCount += 1;
+	Entry* victim = &Entries[0];
+	for (auto&& e : Entries)
+	{
+		if (!e.Block.IsNull() && e.Block.GetRawData() == block.GetRawData())
+		{
+			e.LastUse = UseCount;
+			return e.Decoded.GetRawData();
+		}
+		if (e.LastUse < victim->LastUse)
+		{
+			victim = &e;
+		}
+	}
+	victim->Block.TryClearRef();
+	victim->Decoded.TryClearRef();
+	//Keep a reference to the block, so that it is not reused by another block.
+	victim->Block = block.NewRef();
+	victim->Decoded = BlockCompression::DecodeBlock(block);
+	victim->LastUse = UseCount;
+	return victim->Decoded.GetRawData();
+}
+
+void Mimi::DecodedBlockCache::Clear()
+{
+	for (auto&& e : Entries)
+	{
+		e.Block.TryClearRef();
+		e.Decoded.TryClearRef();
+		e.LastUse = 0;
+	}
+}
+
+std::size_t Mimi::DecodedBlockCache::GetMemorySize()
+{
+	std::size_t ret = 0;
+	for (auto&& e : Entries)
+	{
+		if (!e.Decoded.IsNull())
+		{
+			ret += e.Decoded.GetSize();
+		}
+	}
+	return ret;
+}
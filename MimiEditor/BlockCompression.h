@@ -0,0 +1,68 @@
+#pragma once
+#include "Buffer.h"
+#include <cstdint>
+#include <cstddef>
+
+namespace Mimi
+{
+	//A fast block compressor (LZ4 block format, without frames).
+	//It is used to store the content of cold inactive segments. Content of
+	//several segments is compressed together into a block, which is a
+	//StaticBuffer shared (and refcounted) by these segments:
+	//  2 bytes: decoded size (little-endian)
+	//  compressed data
+	class BlockCompression final
+	{
+		BlockCompression() {}
+
+	public:
+		//Maximum decoded size of a block.
+		static const std::size_t MaxBlockSize = 0x4000;
+
+	public:
+		//Return the compressed size, or 0 if dest is not large enough.
+		static std::size_t Compress(const std::uint8_t* src, std::size_t srcLen,
+			std::uint8_t* dest, std::size_t destLen);
+		//Return false if the data is corrupted or does not decode to exactly destLen.
+		static bool Decompress(const std::uint8_t* src, std::size_t srcLen,
+			std::uint8_t* dest, std::size_t destLen);
+
+	public:
+		//Make a compressed block. Return a null buffer if the data can't be
+		//compressed to less than 3/4 of its size.
+		static StaticBuffer MakeBlock(const std::uint8_t* src, std::size_t len);
+		static std::size_t GetDecodedSize(StaticBuffer block);
+		static StaticBuffer DecodeBlock(StaticBuffer block);
+	};
+
+	//A small LRU cache of decoded blocks, owned by the document. Not thread-safe.
+	class DecodedBlockCache final
+	{
+	public:
+		static const std::size_t Capacity = 8;
+
+	public:
+		DecodedBlockCache();
+		DecodedBlockCache(const DecodedBlockCache&) = delete;
+		DecodedBlockCache(DecodedBlockCache&&) = delete;
+		DecodedBlockCache& operator= (const DecodedBlockCache&) = delete;
+		~DecodedBlockCache();
+
+	private:
+		struct Entry
+		{
+			StaticBuffer Block;
+			StaticBuffer Decoded;
+			std::uint64_t LastUse;
+		};
+
+		Entry Entries[Capacity];
+		std::uint64_t UseCount;
+
+	public:
+		//Get decoded data of a block. The pointer is valid until the next call.
+		const std::uint8_t* Get(StaticBuffer block);
+		void Clear();
+		std::size_t GetMemorySize();
+	};
+}
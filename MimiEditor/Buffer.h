@@ -3,20 +3,31 @@
 #include <cstddef>
 #include <cstring>
 #include <cassert>
+#include <atomic>
+#include <new>
 
 namespace Mimi
 {
 	class DynamicBuffer;
-
+	class BlockCompression;
+
+	//Immutable reference-counted buffer.
+	//By default the reference count is only accessed by the document thread, and
+	//the atomic counter is updated with plain (relaxed) load and store. Once a
+	//buffer is marked thread-safe (MakeThreadSafe), it may be shared with other
+	//threads and all later references use atomic read-modify-write operations.
+	//The mark must be set by the thread owning the buffer before it is shared.
 	struct StaticBuffer
 	{
 		friend class DynamicBuffer;
+		friend class BlockCompression;
 
 	private:
 		struct StaticBufferData
 		{
-			std::uint16_t RefCount;
+			std::atomic<std::uint32_t> RefCount;
 			std::uint16_t Size;
+			bool ThreadSafe;
 			std::uint8_t RawData[1];
 		};
 
@@ -24,33 +35,79 @@ namespace Mimi
 
 		static StaticBufferData* AllocateData(std::size_t size)
 		{
-			char* data = new char[sizeof(StaticBufferData) + size - 2];
-			StaticBufferData* ptr = reinterpret_cast<StaticBufferData*>(data);
+			//Always keep at least 1 byte for RawData.
+			std::size_t rawSize = size ? size : 1;
+			char* data = new char[offsetof(StaticBufferData, RawData) + rawSize];
+			StaticBufferData* ptr = new (data) StaticBufferData;
+			ptr->RefCount.store(1, std::memory_order_relaxed);
+			ptr->Size = static_cast<std::uint16_t>(size);
+			ptr->ThreadSafe = false;
 			return ptr;
 		}
 
+		static void FreeData(StaticBufferData* ptr)
+		{
+			ptr->~StaticBufferData();
+			delete[] reinterpret_cast<char*>(ptr);
+		}
+
 	private:
-		void IncreaseRef()
+		//Only the shared count is changed, not the handle.
+		void IncreaseRef() const
 		{
 			assert(Data);
-			Data->RefCount += 1;
+			if (Data->ThreadSafe)
+			{
+				std::uint32_t old = Data->RefCount.fetch_add(1, std::memory_order_relaxed);
+				assert(old != UINT32_MAX);
+			}
+			else
+			{
+				std::uint32_t old = Data->RefCount.load(std::memory_order_relaxed);
+				assert(old != UINT32_MAX);
+				Data->RefCount.store(old + 1, std::memory_order_relaxed);
+			}
 		}
 
 		void DecreaseRef()
 		{
 			assert(Data);
-			if (--Data->RefCount == 0)
+			if (Data->ThreadSafe)
 			{
-				delete[] reinterpret_cast<char*>(Data);
+				if (Data->RefCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				{
+					FreeData(Data);
+				}
+			}
+			else
+			{
+				std::uint32_t old = Data->RefCount.load(std::memory_order_relaxed);
+				assert(old > 0);
+				if (old == 1)
+				{
+					FreeData(Data);
+				}
+				else
+				{
+					Data->RefCount.store(old - 1, std::memory_order_relaxed);
+				}
 			}
 		}
 
 	public:
+		static StaticBuffer Create(const std::uint8_t* data, std::size_t size)
+		{
+			StaticBufferData* ptr = AllocateData(size);
+			std::memcpy(ptr->RawData, data, size);
+
+			StaticBuffer ret;
+			ret.Data = ptr;
+			return ret;
+		}
+
 		static StaticBuffer CreateEmpty()
 		{
-			StaticBufferData* data = new StaticBufferData();
-			data->RefCount = 1;
-			data->Size = 0;
+			StaticBufferData* data = AllocateData(0);
 			data->RawData[0] = 0;
 
 			StaticBuffer ret;
@@ -59,7 +116,7 @@ namespace Mimi
 		}
 
 	public:
-		StaticBuffer NewRef()
+		StaticBuffer NewRef() const
 		{
 			IncreaseRef();
 			return *this;
@@ -74,11 +131,7 @@ namespace Mimi
 
 		void ClearRef()
 		{
-			assert(Data);
-			if (--Data->RefCount == 0)
-			{
-				delete[] reinterpret_cast<char*>(Data);
-			}
+			DecreaseRef();
 			Clear();
 		}
 
@@ -90,6 +143,31 @@ namespace Mimi
 			}
 		}
 
+		//Allow references of this buffer to be created and released on other
+		//threads. This can't be undone.
+		void MakeThreadSafe()
+		{
+			assert(Data);
+			if (!Data->ThreadSafe)
+			{
+				//Only the owner thread holds references now.
+				Data->ThreadSafe = true;
+			}
+		}
+
+		bool IsThreadSafe() const
+		{
+			assert(Data);
+			return Data->ThreadSafe;
+		}
+
+		//True if this is the only reference.
+		bool IsUnique() const
+		{
+			assert(Data);
+			return Data->RefCount.load(std::memory_order_acquire) == 1;
+		}
+
 	public:
 		std::uint16_t GetSize() const
 		{
@@ -109,18 +187,42 @@ namespace Mimi
 			Data = nullptr;
 		}
 
-		bool IsNull()
+		bool IsNull() const
 		{
-			return Data != nullptr;
+			return Data == nullptr;
 		}
 	};
 
+	//A range of a StaticBuffer, used by snapshots. If Compressed is set, Buffer is
+	//a compressed block (see BlockCompression) and the range refers to the
+	//decoded data.
+	struct StaticBufferRange
+	{
+		StaticBuffer Buffer;
+		std::uint16_t Offset;
+		std::uint16_t Length;
+		bool Compressed;
+		bool Continuous; //Continues the line of the previous range.
+	};
+
+	//A growable buffer (up to 64KB).
+	//Besides normal (contiguous) editing, it supports a gap mode used by active
+	//segments (GapReplace): the free space is kept at the last edit position, so
+	//that continuous typing only moves the bytes between two edit positions
+	//instead of the whole tail. The gap is closed (data made contiguous again)
+	//when any other function needs a contiguous view.
 	class DynamicBuffer
 	{
 		static const std::size_t MaxCapacity = 0xFFFF;
 		static const std::size_t MinCapacity = 32;
 
 	public:
+		//Empty buffer. Memory is allocated on first modification.
+		DynamicBuffer()
+		{
+			SetEmpty();
+		}
+
 		DynamicBuffer(std::size_t capacity)
 		{
 			assert(capacity <= MaxCapacity);
@@ -129,6 +231,8 @@ namespace Mimi
 			Length = 0;
 			Capacity = static_cast<std::uint16_t>(capacity);
 			IsExternalBuffer = false;
+			GapPosition = 0;
+			IsGapOpen = false;
 		}
 
 		//Use an external memory block.
@@ -139,13 +243,58 @@ namespace Mimi
 			Length = buffer.GetSize();
 			Capacity = 0;
 			IsExternalBuffer = true;
+			GapPosition = 0;
+			IsGapOpen = false;
 		}
 
 		DynamicBuffer(const DynamicBuffer&) = delete;
-		DynamicBuffer(DynamicBuffer&&) = delete;
 		DynamicBuffer& operator= (const DynamicBuffer&) = delete;
 
+		//Take over the memory of other, which becomes empty.
+		DynamicBuffer(DynamicBuffer&& other)
+		{
+			TakeFrom(other);
+		}
+
+		DynamicBuffer& operator= (DynamicBuffer&& other)
+		{
+			if (this != &other)
+			{
+				Free();
+				TakeFrom(other);
+			}
+			return *this;
+		}
+
 		~DynamicBuffer()
+		{
+			Free();
+		}
+
+	private:
+		std::uint8_t* Pointer;
+		StaticBuffer ExternalBuffer;
+		std::uint16_t Length;
+		std::uint16_t Capacity;
+		bool IsExternalBuffer;
+
+		//Gap mode. When IsGapOpen, data before GapPosition is at the beginning
+		//of Pointer, and data after it is at the end of Pointer.
+		bool IsGapOpen;
+		std::uint16_t GapPosition;
+
+	private:
+		void SetEmpty()
+		{
+			Pointer = nullptr;
+			ExternalBuffer.Clear();
+			Length = Capacity = 0;
+			IsExternalBuffer = false;
+			GapPosition = 0;
+			IsGapOpen = false;
+		}
+
+		void Free()
 		{
 			if (!IsExternalBuffer)
 			{
@@ -161,12 +310,17 @@ namespace Mimi
 			}
 		}
 
-	private:
-		std::uint8_t* Pointer;
-		StaticBuffer ExternalBuffer;
-		std::uint16_t Length;
-		std::uint16_t Capacity;
-		bool IsExternalBuffer;
+		void TakeFrom(DynamicBuffer& other)
+		{
+			Pointer = other.Pointer;
+			ExternalBuffer = other.ExternalBuffer;
+			Length = other.Length;
+			Capacity = other.Capacity;
+			IsExternalBuffer = other.IsExternalBuffer;
+			GapPosition = other.GapPosition;
+			IsGapOpen = other.IsGapOpen;
+			other.SetEmpty();
+		}
 
 	public:
 		std::size_t GetLength() const
@@ -174,9 +328,27 @@ namespace Mimi
 			return Length;
 		}
 
+		//Size of the memory block in use (including the shared external buffer).
+		std::size_t GetMemorySize() const
+		{
+			if (IsExternalBuffer)
+			{
+				return ExternalBuffer.GetSize();
+			}
+			return Capacity;
+		}
+
+		//Readonly. This closes the gap.
+		const std::uint8_t* GetRawData()
+		{
+			CloseGap();
+			return static_cast<const DynamicBuffer*>(this)->GetRawData();
+		}
+
 		//Readonly
 		const std::uint8_t* GetRawData() const
 		{
+			assert(!IsGapOpen);
 			if (IsExternalBuffer)
 			{
 				return ExternalBuffer.GetRawData();
@@ -190,58 +362,142 @@ namespace Mimi
 		std::uint8_t* GetPointer()
 		{
 			assert(!IsExternalBuffer);
+			CloseGap();
 			return Pointer;
 		}
 
+		//Copy without closing the gap.
 		std::size_t CopyTo(std::uint8_t* buffer, std::size_t pos, std::size_t len) const
 		{
+			assert(pos <= Length);
 			std::size_t copyLen = Length - pos;
 			if (len < copyLen)
 			{
 				copyLen = len;
 			}
+			if (copyLen == 0)
+			{
+				return 0;
+			}
 			if (IsExternalBuffer)
 			{
-				std::memcpy(buffer, ExternalBuffer.GetRawData(), copyLen);
+				std::memcpy(buffer, &ExternalBuffer.GetRawData()[pos], copyLen);
+			}
+			else if (!IsGapOpen)
+			{
+				std::memcpy(buffer, &Pointer[pos], copyLen);
 			}
 			else
 			{
-				std::memcpy(buffer, Pointer, copyLen);
+				std::size_t end = pos + copyLen;
+				std::size_t tailStart = Capacity - (Length - GapPosition);
+				if (pos < GapPosition)
+				{
+					std::size_t front = (end < GapPosition ? end : GapPosition) - pos;
+					std::memcpy(buffer, &Pointer[pos], front);
+					buffer += front;
+					pos += front;
+				}
+				if (pos < end)
+				{
+					std::memcpy(buffer, &Pointer[tailStart + pos - GapPosition], end - pos);
+				}
 			}
 			return copyLen;
 		}
 
-		StaticBuffer MakeStaticBuffer() const
+		//Readonly view without closing the gap: the data before the gap is in
+		//front, and the data after it is in back (empty if there is no gap).
+		void GetParts(const std::uint8_t** front, std::size_t* frontLength,
+			const std::uint8_t** back, std::size_t* backLength) const
 		{
-			StaticBuffer::StaticBufferData* ptr = StaticBuffer::AllocateData(Length);
-			ptr->RefCount = 1;
-			ptr->Size = Length;
 			if (IsExternalBuffer)
 			{
-				std::memcpy(ptr->RawData, ExternalBuffer.GetRawData(), Length);
+				*front = ExternalBuffer.GetRawData();
+				*frontLength = Length;
+				*back = nullptr;
+				*backLength = 0;
+			}
+			else if (!IsGapOpen)
+			{
+				*front = Pointer;
+				*frontLength = Length;
+				*back = nullptr;
+				*backLength = 0;
 			}
 			else
 			{
-				std::memcpy(ptr->RawData, Pointer, Length);
+				*front = Pointer;
+				*frontLength = GapPosition;
+				*back = &Pointer[Capacity - (Length - GapPosition)];
+				*backLength = Length - GapPosition;
 			}
+		}
+
+		//Make a copy without closing the gap.
+		StaticBuffer MakeStaticBuffer() const
+		{
+			StaticBuffer::StaticBufferData* ptr = StaticBuffer::AllocateData(Length);
+			CopyTo(ptr->RawData, 0, Length);
 
 			StaticBuffer ret;
 			ret.Data = ptr;
 			return ret;
 		}
 
+	private:
+		void MoveGap(std::size_t pos)
+		{
+			assert(IsGapOpen && !IsExternalBuffer);
+			assert(pos <= Length);
+			std::size_t tailStart = Capacity - (Length - GapPosition);
+			if (pos < GapPosition)
+			{
+				std::size_t move = GapPosition - pos;
+				std::memmove(&Pointer[tailStart - move], &Pointer[pos], move);
+			}
+			else if (pos > GapPosition)
+			{
+				std::size_t move = pos - GapPosition;
+				std::memmove(&Pointer[GapPosition], &Pointer[tailStart], move);
+			}
+			GapPosition = static_cast<std::uint16_t>(pos);
+		}
+
+	public:
+		bool HasGap() const
+		{
+			return IsGapOpen;
+		}
+
+		//Make the data contiguous.
+		void CloseGap()
+		{
+			if (!IsGapOpen) return;
+			MoveGap(Length);
+			IsGapOpen = false;
+		}
+
 	private:
 		void EnsureInternalBuffer(std::size_t newSize, bool copy)
 		{
 			assert(newSize <= MaxCapacity);
+			if (copy)
+			{
+				CloseGap();
+			}
+			else
+			{
+				IsGapOpen = false;
+			}
 			if (IsExternalBuffer)
 			{
-				std::uint16_t capacity = static_cast<std::uint16_t>(newSize);
+				//Data is moved after copying, so keep at least the current length.
+				std::uint16_t capacity = static_cast<std::uint16_t>(newSize > Length ? newSize : Length);
 				std::uint8_t* newBuffer = new std::uint8_t[capacity];
 				if (copy)
 				{
-					std::size_t copyLen = Length < capacity ? Length : capacity;
-					std::memcpy(newBuffer, ExternalBuffer.GetRawData(), copyLen);
+					std::memcpy(newBuffer, ExternalBuffer.GetRawData(), Length);
 				}
 				Pointer = newBuffer;
 				Capacity = capacity;
@@ -252,8 +508,9 @@ namespace Mimi
 			{
 				std::uint16_t capacity = Capacity + Capacity / 2;
 				if (capacity < newSize) capacity = static_cast<std::uint16_t>(newSize);
+				if (capacity < MinCapacity) capacity = MinCapacity; //Empty buffer
 				std::uint8_t* newBuffer = new std::uint8_t[capacity];
-				if (copy)
+				if (copy && Length > 0)
 				{
 					std::size_t copyLen = Length < capacity ? Length : capacity;
 					std::memcpy(newBuffer, Pointer, copyLen);
@@ -317,9 +574,34 @@ namespace Mimi
 			return &Pointer[pos];
 		}
 
+		//Replace in gap mode. The gap is moved to pos and left after the new data.
+		void GapReplace(std::size_t pos, std::size_t sel, const std::uint8_t* data, std::size_t dataLen)
+		{
+			assert(pos + sel <= Length);
+			assert(Length - sel + dataLen <= MaxCapacity);
+			std::size_t newLength = Length - sel + dataLen;
+			if (IsExternalBuffer || Capacity < newLength + 4)
+			{
+				//Reallocate (in contiguous mode). Gap is at the end afterwards.
+				EnsureInternalBuffer(newLength, true);
+			}
+			if (!IsGapOpen)
+			{
+				GapPosition = Length;
+				IsGapOpen = true;
+			}
+			MoveGap(pos);
+			//Data after the gap is aligned to the end, so deleted data is simply dropped.
+			Length -= static_cast<std::uint16_t>(sel);
+			if (dataLen) std::memcpy(&Pointer[GapPosition], data, dataLen);
+			GapPosition += static_cast<std::uint16_t>(dataLen);
+			Length += static_cast<std::uint16_t>(dataLen);
+		}
+
 		void FastAppend(const std::uint8_t* data, std::size_t len)
 		{
 			assert(!IsExternalBuffer);
+			CloseGap();
 			assert(Length + len <= Capacity);
 			assert(len > 0);
 			assert(len <= 4);
@@ -331,10 +613,12 @@ namespace Mimi
 	public:
 		void Shink()
 		{
-			if (IsExternalBuffer) return;
+			if (IsExternalBuffer || Pointer == nullptr) return;
+			CloseGap();
 			std::uint16_t capacity = Capacity;
-			while (capacity > Length + 4) capacity /= 2;
+			while (capacity / 2 >= Length + 4) capacity /= 2;
 			if (capacity < MinCapacity) capacity = MinCapacity;
+			if (capacity >= Capacity) return;
 			std::uint8_t* newBuffer = new std::uint8_t[capacity];
 			std::memcpy(newBuffer, Pointer, Length);
 			delete[] Pointer;
@@ -0,0 +1,68 @@
+#include "BufferInternTable.h"
+
+Mimi::BufferInternTable::~BufferInternTable()
+{
+	Clear();
+}
+
+std::uint64_t Mimi::BufferInternTable::Hash(const std::uint8_t* data, std::size_t size)
+{
+	//FNV-1a
+	std::uint64_t h = 14695981039346656037ull;
+	for (std::size_t i = 0; i < size; ++i)
+	{
+		h ^= data[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+Mimi::StaticBuffer Mimi::BufferInternTable::Intern(StaticBuffer buffer)
+{
+	std::size_t size = buffer.GetSize();
+	if (size > MaxInternLength)
+	{
+		return buffer;
+	}
+	std::uint64_t h = Hash(buffer.GetRawData(), size);
+	auto range = Table.equal_range(h);
+	for (auto i = range.first; i != range.second; ++i)
+	{
+		StaticBuffer& b = i->second;
+		if (b.GetSize() == size && std::memcmp(b.GetRawData(), buffer.GetRawData(), size) == 0)
+		{
+			buffer.ClearRef();
+			return b.NewRef();
+		}
+	}
+	Table.emplace(h, buffer.NewRef());
+	ContentBytes += size;
+	return buffer;
+}
+
+void Mimi::BufferInternTable::Purge()
+{
+	for (auto i = Table.begin(); i != Table.end(); )
+	{
+		if (i->second.IsUnique())
+		{
+			ContentBytes -= i->second.GetSize();
+			i->second.ClearRef();
+			i = Table.erase(i);
+		}
+		else
+		{
+			++i;
+		}
+	}
+}
+
+void Mimi::BufferInternTable::Clear()
+{
+	for (auto&& e : Table)
+	{
+		e.second.ClearRef();
+	}
+	Table.clear();
+	ContentBytes = 0;
+}
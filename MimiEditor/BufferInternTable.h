@@ -0,0 +1,64 @@
+#pragma once
+#include "Buffer.h"
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+
+namespace Mimi
+{
+	//Content-addressed table of StaticBuffer, owned by the document. Inactive
+	//segments with identical content (blank lines, separators, repeated log
+	//lines) share one buffer found through this table.
+	//The table holds a reference to each buffer. Buffers no longer used by any
+	//segment are released by Purge.
+	class BufferInternTable final
+	{
+	public:
+		//Longer content is not interned: long lines rarely repeat.
+		static const std::size_t MaxInternLength = 1024;
+
+	public:
+		BufferInternTable()
+		{
+			ContentBytes = 0;
+		}
+
+		BufferInternTable(const BufferInternTable&) = delete;
+		BufferInternTable(BufferInternTable&&) = delete;
+		BufferInternTable& operator= (const BufferInternTable&) = delete;
+		~BufferInternTable();
+
+	private:
+		std::unordered_multimap<std::uint64_t, StaticBuffer> Table;
+		std::size_t ContentBytes;
+
+	public:
+		static std::uint64_t Hash(const std::uint8_t* data, std::size_t size);
+
+		//Return a buffer with the same content as buffer, taking over the given
+		//reference. It may be buffer itself (now added to the table).
+		StaticBuffer Intern(StaticBuffer buffer);
+		//Release buffers only referenced by the table.
+		void Purge();
+		void Clear();
+
+	public:
+		std::size_t GetCount()
+		{
+			return Table.size();
+		}
+
+		//Size of the unique content in the table.
+		std::size_t GetContentBytes()
+		{
+			return ContentBytes;
+		}
+
+		//Estimated size of the table itself (buckets and nodes).
+		std::size_t GetTableBytes()
+		{
+			return Table.bucket_count() * sizeof(void*) +
+				Table.size() * (sizeof(std::pair<const std::uint64_t, StaticBuffer>) + 2 * sizeof(void*));
+		}
+	};
+}
@@ -182,6 +182,19 @@ namespace Mimi
 			}
 		}
 
+	public:
+		std::size_t GetHandlerCount()
+		{
+			return Handlers.size();
+		}
+
+		//Estimated size of the handler table (excluding the handler objects).
+		std::size_t GetMemorySize()
+		{
+			return Handlers.size() * (sizeof(typename decltype(Handlers)::value_type) + sizeof(void*)) +
+				Handlers.bucket_count() * sizeof(void*) + UnusedId.size() * sizeof(HandlerId);
+		}
+
 	public:
 		HandlerId AddHandler(IEventHandler<T> h, F filter)
 		{
@@ -306,6 +319,19 @@ namespace Mimi
 			}
 		}
 
+	public:
+		std::size_t GetHandlerCount()
+		{
+			return Handlers.size();
+		}
+
+		//Estimated size of the handler table (excluding the handler objects).
+		std::size_t GetMemorySize()
+		{
+			return Handlers.size() * (sizeof(typename decltype(Handlers)::value_type) + sizeof(void*)) +
+				Handlers.bucket_count() * sizeof(void*) + UnusedId.size() * sizeof(HandlerId);
+		}
+
 	public:
 		HandlerId AddHandler(IEventHandler<T> h)
 		{
@@ -20,10 +20,11 @@ Mimi::ModificationTracer::~ModificationTracer()
 void Mimi::ModificationTracer::Insert(std::size_t pos, std::size_t len)
 {
 	assert(pos < MaxLength && len <= MaxLength - pos);
+	if (len == 0) return; //An entry with Change == 0 would end the list.
 	std::int32_t cpos = static_cast<std::int32_t>(pos);
 	std::int16_t change = static_cast<std::int16_t>(len);
 
-	ShortVector<Modification>& list = this->SnapshotHead->Modifications;
+	ModificationList& list = this->SnapshotHead->Modifications;
 
 	//Find the point to insert
 	Modification* head = list.GetPointer();
@@ -56,17 +57,18 @@ void Mimi::ModificationTracer::Insert(std::size_t pos, std::size_t len)
 		m += 1;
 	}
 	//Reach the last entry.
-	assert(m->Position + delta > cpos && "Modification tracer: insert after the end");
+	assert(m->Position + delta >= cpos && "Modification tracer: insert after the end");
 	list.Insert(m - head, { static_cast<std::uint16_t>(pos - delta), change });
 }
 
 void Mimi::ModificationTracer::Delete(std::size_t pos, std::size_t len)
 {
 	assert(pos < MaxLength && len <= MaxLength - pos);
+	if (len == 0) return;
 	std::int32_t cpos = static_cast<std::int32_t>(pos);
 	std::int16_t clen = static_cast<std::int16_t>(len);
 
-	ShortVector<Modification>& list = this->SnapshotHead->Modifications;
+	ModificationList& list = this->SnapshotHead->Modifications;
 
 	//Find the point to delete
 	Modification* head = list.GetPointer();
@@ -302,6 +304,15 @@ void Mimi::ModificationTracer::Resize(std::size_t size)
 		last = s;
 		s = s->Next;
 	}
+	//Detach the removed nodes.
+	if (last)
+	{
+		last->Next = nullptr;
+	}
+	else
+	{
+		this->SnapshotHead = nullptr;
+	}
 	while (s)
 	{
 		Snapshot* next = s->Next;
@@ -310,6 +321,16 @@ void Mimi::ModificationTracer::Resize(std::size_t size)
 	}
 }
 
+std::size_t Mimi::ModificationTracer::GetMemorySize()
+{
+	std::size_t ret = 0;
+	for (Snapshot* s = SnapshotHead; s; s = s->Next)
+	{
+		ret += sizeof(Snapshot) + s->Modifications.GetHeapSize();
+	}
+	return ret;
+}
+
 std::size_t Mimi::ModificationTracer::GetSnapshotLength(std::size_t snapshot)
 {
 	Snapshot* s = SnapshotHead;
@@ -327,50 +348,92 @@ std::size_t Mimi::ModificationTracer::ConvertFromSnapshotSingle(Snapshot* snapsh
 	Modification* head = snapshot->Modifications.GetPointer();
 	Modification* m = head;
 	std::int32_t delta = 0;
-	while (m->Change)
+	SkipModifications(m, delta, cpos);
+	return ConvertAt(head, m, delta, cpos, dir);
+}
+
+void Mimi::ModificationTracer::SkipModifications(Modification*& m, std::int32_t& delta, std::int32_t cpos)
+{
+	//For insertion, m->Position must be after pos
+	//For deletion, m->Position - m->Change is the end, which must be after pos.
+	while (m->Change && !(m->Position > cpos || m->Position - m->Change > cpos))
+	{
+		delta += m->Change;
+		m += 1;
+	}
+}
+
+std::size_t Mimi::ModificationTracer::ConvertAt(Modification* head, Modification* m,
+	std::int32_t delta, std::int32_t cpos, int dir)
+{
+	if (m->Change == 0)
+	{
+		assert(m->Position > cpos);
+		return static_cast<std::size_t>(cpos + delta);
+	}
+	if (m->Change > 0)
+	{
+		//Insertion after pos.
+		return static_cast<std::size_t>(cpos + delta);
+	}
+	if (m->Position > cpos)
+	{
+		//Deletion after pos
+		return static_cast<std::size_t>(cpos + delta);
+	}
+	//The char is deleted.
+	if (dir == 0) return PositionDeleted;
+	if (dir < 0) return static_cast<std::size_t>(m->Position + delta);
+	//dir > 0
+	if (m == head ||
+		m[-1].Change < 0 ||
+		m[-1].Position != m->Position)
+	{
+		//Note that this may produce (size_t)-1, which gives 0xFFFFFFFF (not found).
+		return static_cast<std::size_t>(m->Position + delta - 1);
+	}
+	else
+	{
+		//Let it go before the adjacent insertion.
+		return static_cast<std::size_t>(m->Position + delta - m[-1].Change - 1);
+	}
+}
+
+void Mimi::ModificationTracer::ConvertFromSnapshotSorted(std::size_t snapshot, std::size_t* pos,
+	const int* dir, std::size_t count)
+{
+	assert(snapshot < MaxSnapshot);
+	Snapshot* chain[MaxSnapshot];
+	Snapshot* s = SnapshotHead;
+	for (std::size_t i = 0; i <= snapshot; ++i)
 	{
-		if (m->Position > cpos || m->Position - m->Change > cpos)
+		chain[i] = s;
+		s = s->Next;
+	}
+	//From the oldest to the newest, as ConvertFromSnapshot.
+	for (std::size_t i = snapshot + 1; i-- > 0;)
+	{
+		Modification* head = chain[i]->Modifications.GetPointer();
+		Modification* m = head;
+		std::int32_t delta = 0;
+		std::size_t last = 0;
+		for (std::size_t j = 0; j < count; ++j)
 		{
-			//For insertion, m->Position must be after pos
-			//For deletion, m->Position - m->Change is the end, which must be after pos.
-			if (m->Change > 0)
+			if (pos[j] == PositionDeleted) continue;
+			assert(pos[j] < MaxLength);
+			if (pos[j] < last)
 			{
-				//Insertion after pos.
-				return static_cast<std::size_t>(cpos + delta);
-			}
-			else
-			{
-				if (m->Position > cpos)
-				{
-					//Deletion after pos
-					return static_cast<std::size_t>(cpos + delta);
-				}
-				else
-				{
-					//The char is deleted.
-					if (dir == 0) return PositionDeleted;
-					if (dir < 0) return static_cast<std::size_t>(m->Position + delta);
-					//dir > 0
-					if (m == head ||
-						m[-1].Change < 0 ||
-						m[-1].Position != m->Position)
-					{
-						//Note that this may produce (size_t)-1, which gives 0xFFFFFFFF (not found).
-						return static_cast<std::size_t>(m->Position + delta - 1);
-					}
-					else
-					{
-						//Let it go before the adjacent insertion.
-						return static_cast<std::size_t>(m->Position + delta - m[-1].Change - 1);
-					}
-				}
+				//Deleted chars (with different dir) can be out of order after
+				//the previous snapshot. Restart from the beginning.
+				m = head;
+				delta = 0;
 			}
+			last = pos[j];
+			std::int32_t cpos = static_cast<std::int32_t>(pos[j]);
+			SkipModifications(m, delta, cpos);
+			pos[j] = ConvertAt(head, m, delta, cpos, dir[j]);
 		}
-		delta += m->Change;
-		m += 1;
 	}
-	assert(m->Position > cpos);
-	return static_cast<std::size_t>(cpos + delta);
 }
 
 std::size_t Mimi::ModificationTracer::FirstModifiedFromSnapshot(std::size_t snapshot)
@@ -390,6 +453,92 @@ std::size_t Mimi::ModificationTracer::FirstModifiedFromSnapshot(std::size_t snap
 	return pos;
 }
 
+void Mimi::ModificationTracer::GetChanges(std::size_t oldSnapshot, std::size_t newSnapshot,
+	std::vector<SnapshotChange>& result)
+{
+	assert(newSnapshot < oldSnapshot && oldSnapshot < MaxSnapshot);
+	Snapshot* chain[MaxSnapshot];
+	Snapshot* s = SnapshotHead;
+	for (std::size_t i = 0; i <= oldSnapshot; ++i)
+	{
+		chain[i] = s;
+		s = s->Next;
+	}
+
+	//Each snapshot in the list changes the text from its snapshot to the next
+	//newer one. Combine them from the oldest.
+	result.clear();
+	std::vector<SnapshotChange> changes, composed;
+	for (std::size_t i = oldSnapshot; i > newSnapshot; --i)
+	{
+		changes.clear();
+		std::size_t delta = 0;
+		for (Modification* m = chain[i]->Modifications.GetPointer(); m->Change; ++m)
+		{
+			if (m->Change > 0)
+			{
+				changes.push_back({ m->Position, 0, m->Position + delta, static_cast<std::size_t>(m->Change) });
+			}
+			else
+			{
+				changes.push_back({ m->Position, static_cast<std::size_t>(-m->Change), m->Position + delta, 0 });
+			}
+			delta += m->Change;
+		}
+		ComposeChanges(result, changes, composed);
+		result.swap(composed);
+	}
+}
+
+void Mimi::ModificationTracer::ComposeChanges(const std::vector<SnapshotChange>& a,
+	const std::vector<SnapshotChange>& b, std::vector<SnapshotChange>& result)
+{
+	//Ranges of both in the middle version (new ranges of a and old ranges of
+	//b) are merged into groups when they overlap or are adjacent. Text between
+	//two groups is not changed by either, so each group maps back to A with
+	//the length change of a before it, and to B with that of b.
+	result.clear();
+	std::size_t i = 0, j = 0;
+	std::size_t deltaA = 0, deltaB = 0; //Length change (can wrap around).
+	while (i < a.size() || j < b.size())
+	{
+		std::size_t start = PositionDeleted, end = 0;
+		std::size_t groupA = 0, groupB = 0;
+		while (true)
+		{
+			bool useA = i < a.size() && (start == PositionDeleted || a[i].NewPosition <= end);
+			bool useB = j < b.size() && (start == PositionDeleted || b[j].OldPosition <= end);
+			if (useA && useB)
+			{
+				//Take the first one.
+				useA = a[i].NewPosition <= b[j].OldPosition;
+				useB = !useA;
+			}
+			if (useA)
+			{
+				if (start == PositionDeleted) start = end = a[i].NewPosition;
+				if (a[i].NewPosition + a[i].NewLength > end) end = a[i].NewPosition + a[i].NewLength;
+				groupA += a[i].NewLength - a[i].OldLength;
+				i += 1;
+			}
+			else if (useB)
+			{
+				if (start == PositionDeleted) start = end = b[j].OldPosition;
+				if (b[j].OldPosition + b[j].OldLength > end) end = b[j].OldPosition + b[j].OldLength;
+				groupB += b[j].NewLength - b[j].OldLength;
+				j += 1;
+			}
+			else
+			{
+				break;
+			}
+		}
+		result.push_back({ start - deltaA, end - start - groupA, start + deltaB, end - start + groupB });
+		deltaA += groupA;
+		deltaB += groupB;
+	}
+}
+
 void Mimi::ModificationTracer::MergeWith(ModificationTracer& other, std::size_t snapshots)
 {
 	Snapshot* sa = this->SnapshotHead;
@@ -522,9 +671,11 @@ void Mimi::ModificationTracer::SplitInto(ModificationTracer& other, std::size_t
 			if (ma->Change == 0)
 			{
 				//Split after any change.
+				//The second part can be empty if this version is shorter (e.g.
+				//a line inserted after the snapshot is split at 0).
 				std::int32_t keep = p - delta;
 				std::int32_t move = ma->Position - keep;
-				assert(move > 0 && "ModificationTracer: split after end.");
+				assert(move >= 0 && "ModificationTracer: split after end.");
 				ma->Position -= move;
 				sb->Modifications.Append({ static_cast<std::uint16_t>(move), 0 });
 				p = keep;
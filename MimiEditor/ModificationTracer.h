@@ -3,9 +3,20 @@
 #include <cstdint>
 #include <cstddef>
 #include <limits>
+#include <vector>
 
 namespace Mimi
 {
+	//A changed range between two versions of the text: OldLength bytes at
+	//OldPosition are replaced by NewLength bytes at NewPosition.
+	struct SnapshotChange
+	{
+		std::size_t OldPosition;
+		std::size_t OldLength;
+		std::size_t NewPosition;
+		std::size_t NewLength;
+	};
+
 	//Trace the modification of one line between snapshots
 	//Current implementation assumes a maximum length of ? (16 bit)
 	//and maximum snapshot number of 255 (8 bit).
@@ -37,13 +48,16 @@ namespace Mimi
 			std::int16_t Change;
 		};
 
+		//Most segments have only a few changes, stored inline.
+		typedef ShortVector<Modification, 3> ModificationList;
+
 		struct Snapshot
 		{
 			Snapshot* Next = nullptr;
 
 			//The last item is always a change=0, indicating
 			//the range of this Tracer (in terms of old length).
-			ShortVector<Modification> Modifications;
+			ModificationList Modifications;
 		};
 
 		Snapshot* SnapshotHead;
@@ -68,6 +82,11 @@ namespace Mimi
 
 	private:
 		std::size_t ConvertFromSnapshotSingle(Snapshot* snapshot, std::size_t pos, int dir);
+		//Move m (with the total change before it in delta) to the first
+		//modification not entirely before cpos.
+		static void SkipModifications(Modification*& m, std::int32_t& delta, std::int32_t cpos);
+		static std::size_t ConvertAt(Modification* head, Modification* m,
+			std::int32_t delta, std::int32_t cpos, int dir);
 		std::size_t ConvertToSnapshotSingle(Snapshot* snapshot, std::size_t pos, int dir);
 
 	private:
@@ -113,8 +132,24 @@ namespace Mimi
 			return newPos;
 		}
 
+		//Convert positions sorted in ascending order (in place), continuing from
+		//the previous position in each snapshot instead of from the beginning.
+		//Deleted positions (dir 0) are set to PositionDeleted and skipped.
+		void ConvertFromSnapshotSorted(std::size_t snapshot, std::size_t* pos,
+			const int* dir, std::size_t count);
+
 		std::size_t FirstModifiedFromSnapshot(std::size_t snapshot);
 
+		//Changed ranges from snapshot oldSnapshot to a newer one (smaller index),
+		//sorted and merged when adjacent.
+		void GetChanges(std::size_t oldSnapshot, std::size_t newSnapshot,
+			std::vector<SnapshotChange>& result);
+
+		//Combine the changes from version A to X (a) and from X to B (b) into
+		//the changes from A to B.
+		static void ComposeChanges(const std::vector<SnapshotChange>& a,
+			const std::vector<SnapshotChange>& b, std::vector<SnapshotChange>& result);
+
 	public:
 		//Merge this tracer with 'other'.
 		//All snapshots are merged (number given in 'snapshot'). After this, 'other' can be
@@ -128,6 +163,10 @@ namespace Mimi
 		//snapshots. Snapshot items will be modified from the beginning.
 		void SplitInto(ModificationTracer& other, std::size_t snapshots, std::size_t pos);
 
+	public:
+		//Heap memory used by the snapshot lists.
+		std::size_t GetMemorySize();
+
 	public:
 		//Used in test and debug cases only.
 		bool CheckSequence(std::size_t numSnapshot, std::size_t rangeCheck);
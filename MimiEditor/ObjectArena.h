@@ -0,0 +1,143 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+#include <new>
+#include <utility>
+
+namespace Mimi
+{
+	//A fixed-size object pool used by TextDocument to allocate its segments and
+	//tree nodes.
+	//Objects are carved from blocks of BlockSize slots, so objects allocated one
+	//after another (e.g. when loading a file) are adjacent in memory. Freed slots
+	//are kept in a free list and reused first (LIFO), which keeps newly split
+	//segments close to their siblings.
+	//The arena never returns memory to the system until it is destroyed. Then all
+	//blocks are released at once, without touching each object. Destructors are
+	//NOT called at that time: the owner must destroy objects that hold resources
+	//(Destroy) before the arena goes away.
+	template <typename T, std::size_t BlockSize = 64>
+	class ObjectArena final
+	{
+		static_assert(BlockSize > 0, "ObjectArena: empty block.");
+
+		union Slot
+		{
+			Slot* NextFree;
+			alignas(T) std::uint8_t Storage[sizeof(T)];
+		};
+
+		struct Block
+		{
+			Block* Next;
+			std::uint8_t* Memory; //Block is placed in it with the alignment of T.
+			Slot Slots[BlockSize];
+		};
+
+	public:
+		ObjectArena()
+		{
+			BlockHead = nullptr;
+			FreeHead = nullptr;
+			NextSlot = BlockSize;
+			LiveCount = 0;
+			BlockCount = 0;
+		}
+
+		ObjectArena(const ObjectArena&) = delete;
+		ObjectArena(ObjectArena&&) = delete;
+		ObjectArena& operator= (const ObjectArena&) = delete;
+
+		~ObjectArena()
+		{
+			Block* b = BlockHead;
+			while (b)
+			{
+				Block* next = b->Next;
+				std::uint8_t* memory = b->Memory;
+				b->~Block();
+				delete[] memory;
+				b = next;
+			}
+			BlockHead = nullptr;
+			FreeHead = nullptr;
+		}
+
+	private:
+		Block* BlockHead;
+		Slot* FreeHead;
+		std::size_t NextSlot; //Next unused slot in BlockHead.
+		std::size_t LiveCount;
+		std::size_t BlockCount;
+
+	public:
+		//Raw allocation. Used by classes which construct the object themselves
+		//(private constructors).
+		void* Allocate()
+		{
+			LiveCount += 1;
+			if (FreeHead)
+			{
+				Slot* ret = FreeHead;
+				FreeHead = ret->NextFree;
+				return ret->Storage;
+			}
+			if (NextSlot == BlockSize)
+			{
+				//Operator new doesn't support over-aligned types (e.g. cache line
+				//aligned nodes) before C++17.
+				std::uint8_t* memory = new std::uint8_t[sizeof(Block) + alignof(Block)];
+				std::size_t offset = alignof(Block) -
+					reinterpret_cast<std::uintptr_t>(memory) % alignof(Block);
+				Block* b = new (memory + offset) Block;
+				b->Memory = memory;
+				b->Next = BlockHead;
+				BlockHead = b;
+				NextSlot = 0;
+				BlockCount += 1;
+			}
+			return BlockHead->Slots[NextSlot++].Storage;
+		}
+
+		void Free(void* ptr)
+		{
+			assert(ptr);
+			assert(LiveCount > 0);
+			Slot* s = reinterpret_cast<Slot*>(ptr);
+			s->NextFree = FreeHead;
+			FreeHead = s;
+			LiveCount -= 1;
+		}
+
+		template <typename... A>
+		T* New(A&&... args)
+		{
+			return new (Allocate()) T(std::forward<A>(args)...);
+		}
+
+		void Delete(T* obj)
+		{
+			obj->~T();
+			Free(obj);
+		}
+
+		//Only call the destructor. The memory is released with the arena.
+		void Destroy(T* obj)
+		{
+			obj->~T();
+			LiveCount -= 1;
+		}
+
+	public:
+		std::size_t GetLiveCount() const
+		{
+			return LiveCount;
+		}
+
+		std::size_t GetReservedSize() const
+		{
+			return BlockCount * (sizeof(Block) + alignof(Block));
+		}
+	};
+}
@@ -7,47 +7,135 @@
 
 namespace Mimi
 {
-	template <typename T>
+	//A vector of trivial types with 16-bit count and capacity.
+	//Up to InlineCapacity elements are stored in the object itself (sharing the
+	//space with the heap pointer), so small vectors don't allocate. The storage
+	//moves to the heap when it grows larger, and back when shrunk.
+	template <typename T, std::size_t InlineCapacity = 0>
 	class ShortVector
 	{
 	public:
 		static const std::size_t MaxCapacity = 0xFFFF;
 		static_assert(std::is_trivial<T>::value, "ShortVector only supports trivial types.");
+		static_assert(InlineCapacity < MaxCapacity, "ShortVector: inline capacity too large.");
+
+	private:
+		static const std::size_t StorageSize = InlineCapacity * sizeof(T) > sizeof(T*) ?
+			InlineCapacity * sizeof(T) : sizeof(T*);
 
 	public:
 		ShortVector()
 		{
-			Pointer = nullptr;
-			Count = Capacity = 0;
+			SetHeapPointer(nullptr);
+			Count = 0;
+			Capacity = InlineCapacity;
+		}
+
+		ShortVector(const ShortVector&) = delete;
+		ShortVector& operator= (const ShortVector&) = delete;
+
+		//Take over the storage of other, which becomes empty.
+		ShortVector(ShortVector&& other)
+		{
+			std::memcpy(Storage, other.Storage, StorageSize);
+			Count = other.Count;
+			Capacity = other.Capacity;
+			other.SetHeapPointer(nullptr);
+			other.Count = 0;
+			other.Capacity = InlineCapacity;
 		}
 
-		ShortVector(const ShortVector<T>&) = delete;
-		ShortVector(ShortVector<T>&&) = delete;
-		ShortVector<T>& operator= (const ShortVector<T>&) = delete;
+		ShortVector& operator= (ShortVector&& other)
+		{
+			if (this != &other)
+			{
+				FreeHeap();
+				std::memcpy(Storage, other.Storage, StorageSize);
+				Count = other.Count;
+				Capacity = other.Capacity;
+				other.SetHeapPointer(nullptr);
+				other.Count = 0;
+				other.Capacity = InlineCapacity;
+			}
+			return *this;
+		}
 
 		~ShortVector()
 		{
-			delete[] Pointer;
-			Pointer = nullptr;
-			Count = Capacity = 0;
+			FreeHeap();
+			Count = 0;
+			Capacity = InlineCapacity;
 		}
 
 	private:
-		T* Pointer;
+		//Either the heap pointer or the inline elements.
+		alignas(T*) alignas(T) std::uint8_t Storage[StorageSize];
 		std::uint16_t Count;
 		std::uint16_t Capacity;
 
+	private:
+		bool IsInline() const
+		{
+			return Capacity == InlineCapacity;
+		}
+
+		T* GetHeapPointer() const
+		{
+			T* ret;
+			std::memcpy(&ret, Storage, sizeof(T*));
+			return ret;
+		}
+
+		void SetHeapPointer(T* ptr)
+		{
+			std::memcpy(Storage, &ptr, sizeof(T*));
+		}
+
+		void FreeHeap()
+		{
+			if (!IsInline())
+			{
+				delete[] GetHeapPointer();
+				SetHeapPointer(nullptr);
+			}
+		}
+
+		//Move the elements to a new storage of the given capacity.
+		void Reallocate(std::size_t newCapacity)
+		{
+			assert(newCapacity >= Count);
+			if (newCapacity <= InlineCapacity)
+			{
+				if (IsInline()) return;
+				T* old = GetHeapPointer();
+				std::memcpy(Storage, old, Count * sizeof(T));
+				delete[] old;
+				Capacity = InlineCapacity;
+			}
+			else
+			{
+				T* newPointer = new T[newCapacity];
+				if (Count > 0)
+				{
+					std::memcpy(newPointer, GetPointer(), Count * sizeof(T));
+				}
+				FreeHeap();
+				SetHeapPointer(newPointer);
+				Capacity = static_cast<std::uint16_t>(newCapacity);
+			}
+		}
+
 	public:
 		void Append(T&& val)
 		{
 			EnsureExtra(1);
-			Pointer[Count++] = val;
+			GetPointer()[Count++] = val;
 		}
 
 		void ApendRange(T* data, std::size_t num)
 		{
 			EnsureExtra(num);
-			std::memcpy(&Pointer[Count], data, num * sizeof(T));
+			std::memcpy(&GetPointer()[Count], data, num * sizeof(T));
 			Count += static_cast<std::uint16_t>(num);
 		}
 
@@ -55,15 +143,16 @@ namespace Mimi
 		{
 			EnsureExtra(1);
 			assert(pos <= Count && "ShortVector: insert after the end.");
-			std::memmove(&Pointer[pos + 1], &Pointer[pos], (Count - pos) * sizeof(T));
-			Pointer[pos] = val;
+			T* pointer = GetPointer();
+			std::memmove(&pointer[pos + 1], &pointer[pos], (Count - pos) * sizeof(T));
+			pointer[pos] = val;
 			Count += 1;
 		}
 
 		T* Emplace(std::size_t num = 1)
 		{
 			EnsureExtra(num);
-			T* ret = &Pointer[Count];
+			T* ret = &GetPointer()[Count];
 			Count += static_cast<std::uint16_t>(num);
 			return ret;
 		}
@@ -72,31 +161,24 @@ namespace Mimi
 		{
 			assert(num < MaxCapacity - Count);
 			if (Count + num <= Capacity) return;
-			if (Capacity == 0)
+			std::size_t newCapacity = Capacity > 2 ? Capacity * 2 : 2;
+			while (newCapacity < Count + num)
 			{
-				Capacity = 2;
-				Pointer = new T[Capacity];
+				newCapacity *= 2;
 			}
-			else
+			if (newCapacity > MaxCapacity)
 			{
-				std::uint16_t newCapacity = Capacity * 2;
-				while (newCapacity < Count + num)
-				{
-					newCapacity *= 2;
-				}
-				T* newPointer = new T[newCapacity];
-				std::memcpy(newPointer, Pointer, Count * sizeof(T));
-				delete[] Pointer;
-				Pointer = newPointer;
-				Capacity = newCapacity;
+				newCapacity = MaxCapacity;
 			}
+			Reallocate(newCapacity);
 		}
 
 		//Ensure the Pointer is unchanged
 		void RemoveRange(std::size_t start, std::size_t len)
 		{
 			assert(start <= Count && len <= Count - start);
-			std::memmove(&Pointer[start], &Pointer[start + len], (Count - start - len) * sizeof(T));
+			T* pointer = GetPointer();
+			std::memmove(&pointer[start], &pointer[start + len], (Count - start - len) * sizeof(T));
 			Count -= static_cast<std::uint16_t>(len);
 		}
 
@@ -114,12 +196,13 @@ namespace Mimi
 		{
 			if (capacity < Capacity && capacity >= Count)
 			{
-				assert(capacity > 0);
-				T* newPointer = new T[capacity];
-				std::memcpy(newPointer, Pointer, Count * sizeof(T));
-				delete[] Pointer;
-				Pointer = newPointer;
-				Capacity = static_cast<std::uint16_t>(capacity);
+				if (capacity == 0 && InlineCapacity == 0)
+				{
+					FreeHeap();
+					Capacity = 0;
+					return;
+				}
+				Reallocate(capacity);
 			}
 		}
 
@@ -130,7 +213,11 @@ namespace Mimi
 
 		T* GetPointer()
 		{
-			return Pointer;
+			if (IsInline())
+			{
+				return InlineCapacity ? reinterpret_cast<T*>(Storage) : nullptr;
+			}
+			return GetHeapPointer();
 		}
 
 		std::size_t GetCount()
@@ -138,9 +225,20 @@ namespace Mimi
 			return Count;
 		}
 
+		std::size_t GetCapacity()
+		{
+			return Capacity;
+		}
+
+		//Memory allocated outside of the object.
+		std::size_t GetHeapSize()
+		{
+			return IsInline() ? 0 : Capacity * sizeof(T);
+		}
+
 		T& operator [](std::size_t index)
 		{
-			return Pointer[index];
+			return GetPointer()[index];
 		}
 	};
 }
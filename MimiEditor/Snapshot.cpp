@@ -8,5 +8,25 @@ Mimi::Snapshot::~Snapshot()
 		Document->DisposeSnapshot(this);
 		Document = nullptr;
 	}
-	assert(BufferList.size() == 0);
+	assert(Root == nullptr);
+}
+
+void Mimi::Snapshot::QueueDispose()
+{
+	assert(Document);
+	Document->QueueDisposeSnapshot(this);
+}
+
+bool Mimi::Snapshot::CheckThreadSafe()
+{
+	SnapshotBufferCursor cursor;
+	cursor.Reset(Root);
+	do
+	{
+		if (!cursor.Get().Buffer.IsThreadSafe())
+		{
+			return false;
+		}
+	} while (cursor.MoveNext());
+	return true;
 }
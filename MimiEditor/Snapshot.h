@@ -1,25 +1,39 @@
 #pragma once
 #include <cstddef>
 #include <cassert>
-#include <vector>
 #include "Buffer.h"
+#include "SnapshotNode.h"
 
 namespace Mimi
 {
 	class TextDocument;
 	class SnapshotPositionConverter;
 	class SnapshotReader;
+	class SnapshotChunkIterator;
+	class SnapshotLineIterator;
+	class SnapshotDiff;
 
+	//Thread safety: a snapshot is created by the document thread. If thread-safe
+	//snapshots are enabled (TextDocument::SetThreadSafeSnapshot) when it's
+	//created, any thread can read it (with its own SnapshotReader or iterator),
+	//as its content is immutable and reference counts of the buffers are
+	//atomic. The document thread deletes it. Other threads call QueueDispose
+	//instead, and must not use it after that. Position conversion
+	//(SnapshotPositionConverter) reads the document, so it's only used by the
+	//document thread.
 	//TODO use AbstractDocument instead of TextDocument.
 	class Snapshot final
 	{
 		friend class TextDocument;
 		friend class SnapshotPositionConverter;
 		friend class SnapshotReader;
+		friend class SnapshotChunkIterator;
+		friend class SnapshotLineIterator;
+		friend class SnapshotDiff;
 
 	private:
 		Snapshot(TextDocument* doc, std::size_t historyIndex)
-			: Document(doc), HistoryIndex(historyIndex)
+			: Document(doc), HistoryIndex(historyIndex), Root(nullptr)
 		{
 		}
 
@@ -30,25 +44,28 @@ namespace Mimi
 
 		~Snapshot();
 
+		//Release the snapshot from any thread. It's deleted by the document
+		//thread later (TextDocument::DisposeQueuedSnapshots).
+		void QueueDispose();
+
+		//For debug use only.
+		//Return true if all buffers can be referenced from other threads.
+		bool CheckThreadSafe();
+
 	private:
 		TextDocument* Document;
 		std::size_t HistoryIndex;
-		std::vector<StaticBuffer> BufferList;
+		//Content, shared with the segment tree and other snapshots.
+		SnapshotNode* Root;
 		std::size_t DataLength;
 
 	private:
-		void AppendBuffer(StaticBuffer buffer)
-		{
-			BufferList.push_back(buffer.MoveRef());
-		}
-
-		void ClearBuffer()
+		//Return the size of snapshot nodes released.
+		std::size_t ClearBuffer()
 		{
-			for (auto&& buffer : BufferList)
-			{
-				buffer.ClearRef();
-			}
-			BufferList.clear();
+			std::size_t ret = Root->ClearRef();
+			Root = nullptr;
+			return ret;
 		}
 
 	private:
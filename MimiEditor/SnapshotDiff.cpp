@@ -0,0 +1,68 @@
+#include "SnapshotDiff.h"
+#include "Snapshot.h"
+#include "TextDocument.h"
+#include "TextSegment.h"
+
+Mimi::SnapshotDiff::SnapshotDiff(Snapshot* oldSnapshot, Snapshot* newSnapshot)
+	: OldSnapshot(oldSnapshot), NewSnapshot(newSnapshot)
+{
+	assert(oldSnapshot->GetDocument() == newSnapshot->GetDocument());
+	assert(oldSnapshot->GetHistoryIndex() <= newSnapshot->GetHistoryIndex());
+	Compute();
+}
+
+void Mimi::SnapshotDiff::Compute()
+{
+	TextDocument* doc = OldSnapshot->GetDocument();
+	TextSegmentTree& tree = doc->SegmentTree;
+	std::size_t oldId = doc->ConvertSnapshotToIndex(OldSnapshot->GetHistoryIndex());
+	std::size_t newId = doc->ConvertSnapshotToIndex(NewSnapshot->GetHistoryIndex());
+	Changes.clear();
+	if (oldId == newId)
+	{
+		return;
+	}
+
+	//Data between two active segments is not changed.
+	doc->GetActiveSegments(ActiveSegments);
+	std::size_t dataEnd = 0, oldEnd = 0, newEnd = 0;
+	for (TextSegment* s : ActiveSegments)
+	{
+		std::size_t dataPosition = tree.ConvertPositionToD({ s, 0 }).Position;
+		std::size_t oldPosition = oldEnd + (dataPosition - dataEnd);
+		std::size_t newPosition = newEnd + (dataPosition - dataEnd);
+		s->GetSnapshotChanges(oldId, newId, SegmentChanges);
+		for (auto&& c : SegmentChanges)
+		{
+			Add({ oldPosition + c.OldPosition, c.OldLength, newPosition + c.NewPosition, c.NewLength });
+		}
+		dataEnd = dataPosition + s->GetCurrentLength();
+		oldEnd = oldPosition + s->GetHistoryLength(oldId);
+		newEnd = newPosition + s->GetHistoryLength(newId);
+	}
+
+	std::size_t dataLength = tree.GetDataLength();
+	if (oldEnd + (dataLength - dataEnd) != OldSnapshot->DataLength ||
+		newEnd + (dataLength - dataEnd) != NewSnapshot->DataLength)
+	{
+		Changes.clear();
+		Changes.push_back({ 0, OldSnapshot->DataLength, 0, NewSnapshot->DataLength });
+	}
+}
+
+void Mimi::SnapshotDiff::Add(const SnapshotChange& c)
+{
+	if (Changes.size())
+	{
+		//Merge with a change at the end of the previous segment.
+		SnapshotChange& last = Changes.back();
+		if (last.OldPosition + last.OldLength == c.OldPosition &&
+			last.NewPosition + last.NewLength == c.NewPosition)
+		{
+			last.OldLength += c.OldLength;
+			last.NewLength += c.NewLength;
+			return;
+		}
+	}
+	Changes.push_back(c);
+}
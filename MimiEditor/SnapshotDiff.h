@@ -0,0 +1,47 @@
+#pragma once
+#include "ModificationTracer.h"
+#include <cstddef>
+#include <vector>
+
+namespace Mimi
+{
+	class Snapshot;
+	class TextSegment;
+
+	//Changed ranges between two snapshots of the same document, computed from
+	//the modification tracers of the segments without reading the content.
+	//Only active segments can change, so the text between them is the same in
+	//both snapshots. History of segments removed from the document is not
+	//kept. If such a segment is found (the lengths do not add up), the whole
+	//document is returned as one change.
+	class SnapshotDiff final
+	{
+	public:
+		//oldSnapshot must be created before newSnapshot.
+		SnapshotDiff(Snapshot* oldSnapshot, Snapshot* newSnapshot);
+		SnapshotDiff(const SnapshotDiff&) = delete;
+		SnapshotDiff(SnapshotDiff&&) = delete;
+		SnapshotDiff& operator= (const SnapshotDiff&) = delete;
+		~SnapshotDiff() {}
+
+	private:
+		Snapshot* OldSnapshot;
+		Snapshot* NewSnapshot;
+		std::vector<SnapshotChange> Changes;
+		std::vector<SnapshotChange> SegmentChanges;
+		std::vector<TextSegment*> ActiveSegments;
+
+	public:
+		//Update the changes. Must be called again after the document changes.
+		void Compute();
+
+		//Sorted, and merged when adjacent.
+		const std::vector<SnapshotChange>& GetChanges()
+		{
+			return Changes;
+		}
+
+	private:
+		void Add(const SnapshotChange& c);
+	};
+}
@@ -0,0 +1,117 @@
+#include "SnapshotNode.h"
+#include <new>
+
+Mimi::SnapshotNode* Mimi::SnapshotNode::New(bool leaf, std::size_t count, std::size_t dataLength)
+{
+	char* data = new char[GetMemorySize(leaf, count)];
+	SnapshotNode* ret = new (data) SnapshotNode;
+	ret->RefCount = 1;
+	ret->ChildrenCount = static_cast<std::uint16_t>(count);
+	ret->IsLeaf = leaf;
+	ret->DataLength = dataLength;
+	return ret;
+}
+
+std::size_t Mimi::SnapshotNode::ClearRef()
+{
+	assert(RefCount > 0);
+	if (--RefCount > 0)
+	{
+		return 0;
+	}
+	std::size_t ret = GetMemorySize();
+	for (std::size_t i = 0; i < ChildrenCount; ++i)
+	{
+		if (IsLeaf)
+		{
+			GetRanges()[i].Buffer.ClearRef();
+		}
+		else
+		{
+			ret += GetChildren()[i]->ClearRef();
+		}
+	}
+	this->~SnapshotNode();
+	delete[] reinterpret_cast<char*>(this);
+	return ret;
+}
+
+void Mimi::SnapshotBufferCursor::Descend(SnapshotNode* node)
+{
+	while (true)
+	{
+		assert(Depth < MaxDepth && node->GetChildrenCount() > 0);
+		Path[Depth] = node;
+		Index[Depth] = 0;
+		Depth += 1;
+		if (node->IsLeafNode()) break;
+		node = node->GetChildren()[0];
+	}
+}
+
+void Mimi::SnapshotBufferCursor::Reset(SnapshotNode* root)
+{
+	Depth = 0;
+	Descend(root);
+}
+
+bool Mimi::SnapshotBufferCursor::MoveNext()
+{
+	assert(Depth > 0);
+	//Find the lowest node with a next child.
+	std::size_t level = Depth - 1;
+	while (Index[level] + 1 >= Path[level]->GetChildrenCount())
+	{
+		if (level == 0)
+		{
+			return false;
+		}
+		level -= 1;
+	}
+	Index[level] += 1;
+	Depth = level + 1;
+	if (!Path[level]->IsLeafNode())
+	{
+		Descend(Path[level]->GetChildren()[Index[level]]);
+	}
+	return true;
+}
+
+std::size_t Mimi::SnapshotBufferCursor::Seek(SnapshotNode* root, std::size_t offset)
+{
+	assert(offset <= root->GetDataLength());
+	Depth = 0;
+	SnapshotNode* node = root;
+	while (true)
+	{
+		assert(Depth < MaxDepth && node->GetChildrenCount() > 0);
+		std::size_t last = node->GetChildrenCount() - 1;
+		std::size_t i = 0;
+		if (node->IsLeafNode())
+		{
+			StaticBufferRange* ranges = node->GetRanges();
+			while (i < last && offset >= ranges[i].Length)
+			{
+				offset -= ranges[i].Length;
+				i += 1;
+			}
+		}
+		else
+		{
+			SnapshotNode** children = node->GetChildren();
+			while (i < last && offset >= children[i]->GetDataLength())
+			{
+				offset -= children[i]->GetDataLength();
+				i += 1;
+			}
+		}
+		Path[Depth] = node;
+		Index[Depth] = i;
+		Depth += 1;
+		if (node->IsLeafNode())
+		{
+			return offset;
+		}
+		node = node->GetChildren()[i];
+	}
+}
@@ -0,0 +1,118 @@
+#pragma once
+#include "Buffer.h"
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+
+namespace Mimi
+{
+	//Immutable copy of a TextSegmentList for snapshots: the content buffer of each
+	//segment (leaf), or the child nodes. Nodes are cached by the tree until the
+	//list changes, so a snapshot only copies the nodes changed since the last
+	//one, and shares others with the tree and other snapshots.
+	//Reference count is only accessed by the document thread.
+	class SnapshotNode final
+	{
+	private:
+		SnapshotNode() = default; //Use New.
+
+	public:
+		SnapshotNode(const SnapshotNode&) = delete;
+		SnapshotNode(SnapshotNode&&) = delete;
+		SnapshotNode& operator= (const SnapshotNode&) = delete;
+
+	private:
+		std::uint32_t RefCount;
+		std::uint16_t ChildrenCount;
+		bool IsLeaf;
+		std::size_t DataLength;
+		//Followed by ChildrenCount StaticBufferRange (leaf) or SnapshotNode*.
+
+	public:
+		//Children (ranges or nodes) must be set by the caller.
+		static SnapshotNode* New(bool leaf, std::size_t count, std::size_t dataLength);
+
+		SnapshotNode* NewRef()
+		{
+			RefCount += 1;
+			return this;
+		}
+
+		//Return the size of memory released (including children).
+		std::size_t ClearRef();
+
+	public:
+		bool IsLeafNode()
+		{
+			return IsLeaf;
+		}
+
+		std::size_t GetChildrenCount()
+		{
+			return ChildrenCount;
+		}
+
+		std::size_t GetDataLength()
+		{
+			return DataLength;
+		}
+
+		StaticBufferRange* GetRanges()
+		{
+			assert(IsLeaf);
+			return reinterpret_cast<StaticBufferRange*>(this + 1);
+		}
+
+		SnapshotNode** GetChildren()
+		{
+			assert(!IsLeaf);
+			return reinterpret_cast<SnapshotNode**>(this + 1);
+		}
+
+		std::size_t GetMemorySize()
+		{
+			return GetMemorySize(IsLeaf, ChildrenCount);
+		}
+
+	private:
+		static std::size_t GetMemorySize(bool leaf, std::size_t count)
+		{
+			return sizeof(SnapshotNode) + count * (leaf ? sizeof(StaticBufferRange) : sizeof(SnapshotNode*));
+		}
+	};
+
+	//Sequential access to the buffers of a snapshot.
+	class SnapshotBufferCursor final
+	{
+		static const std::size_t MaxDepth = 16;
+
+	public:
+		SnapshotBufferCursor()
+			: Depth(0)
+		{
+		}
+
+	private:
+		SnapshotNode* Path[MaxDepth];
+		std::size_t Index[MaxDepth];
+		std::size_t Depth; //0: not positioned.
+
+	public:
+		//Move to the first buffer.
+		void Reset(SnapshotNode* root);
+		//Move to the next buffer. Return false (and stay) at the last one.
+		bool MoveNext();
+		//Move to the buffer containing the offset (the last one for the end),
+		//using the data length of nodes. Return the offset in the buffer.
+		std::size_t Seek(SnapshotNode* root, std::size_t offset);
+
+		const StaticBufferRange& Get()
+		{
+			assert(Depth > 0);
+			return Path[Depth - 1]->GetRanges()[Index[Depth - 1]];
+		}
+
+	private:
+		void Descend(SnapshotNode* node);
+	};
+}
@@ -2,106 +2,118 @@
 #include "Snapshot.h"
 #include "TextDocument.h" //TODO change to abstract document class
 #include "TextSegment.h"
+#include "TextSegmentTreeFinger.h"
+#include <algorithm>
 
 Mimi::SnapshotPositionConverter::SnapshotPositionConverter(Snapshot * s)
-	: SnapshotPtr(s)
+	: SnapshotPtr(s), Version(0), Valid(false)
 {
-	CurrentHistoryPosition = 0;
-	CurrentOffsetInSegment = 0;
-	CurrentSegment = SnapshotPtr->GetDocument()->SegmentTree.GetFirstSegment();
 }
 
-//TODO make it faster: can we avoid starting from the beginning?
 void Mimi::SnapshotPositionConverter::Init()
 {
 	TextDocument* doc = SnapshotPtr->GetDocument();
+	TextSegmentTree& tree = doc->SegmentTree;
 	std::size_t sid = doc->ConvertSnapshotToIndex(SnapshotPtr->GetHistoryIndex());
 
-	TextSegment* s = doc->SegmentTree.GetFirstSegment();
-	std::size_t pos = CurrentHistoryPosition;
-	std::size_t count = 0;
-	std::size_t nextCount = s->GetHistoryLength(sid);
-	while (nextCount <= pos)
+	doc->GetActiveSegments(ActiveSegments);
+	Segments.clear();
+	for (TextSegment* s : ActiveSegments)
 	{
-		count = nextCount;
-		s = s->GetNextSegment();
-		nextCount += s->GetHistoryLength(sid);
+		Segments.push_back({ s, tree.ConvertPositionToD({ s, 0 }).Position, 0, s->GetHistoryLength(sid) });
 	}
-	CurrentSegment = s;
-	CurrentOffsetInSegment = pos - count;
-}
 
-Mimi::DocumentPositionS Mimi::SnapshotPositionConverter::Convert(std::size_t dataPos, int dir)
-{
-	TextDocument* doc = SnapshotPtr->GetDocument();
-	std::size_t sid = doc->ConvertSnapshotToIndex(SnapshotPtr->GetHistoryIndex());
+	//Data between two active segments is not changed.
+	std::size_t dataEnd = 0, historyEnd = 0;
+	for (auto&& c : Segments)
+	{
+		c.HistoryPosition = historyEnd + (c.DataPosition - dataEnd);
+		dataEnd = c.DataPosition + c.Segment->GetCurrentLength();
+		historyEnd = c.HistoryPosition + c.HistoryLength;
+	}
 
-	Seek(dataPos);
-	std::size_t currentPos = CurrentSegment->ConvertSnapshotPosition(sid, CurrentOffsetInSegment, dir);
-	return { CurrentSegment, currentPos };
+	//GetHistoryLength does not change the tree.
+	Version = tree.GetVersion();
+	Valid = true;
 }
 
-void Mimi::SnapshotPositionConverter::Seek(std::size_t dataPos)
+void Mimi::SnapshotPositionConverter::Validate()
 {
-	if (dataPos == CurrentHistoryPosition)
+	if (!Valid || Version != SnapshotPtr->GetDocument()->SegmentTree.GetVersion())
 	{
-		return;
+		Init();
 	}
+}
 
+Mimi::DocumentPositionS Mimi::SnapshotPositionConverter::Convert(std::size_t dataPos, int dir)
+{
 	TextDocument* doc = SnapshotPtr->GetDocument();
+	Validate();
 	std::size_t sid = doc->ConvertSnapshotToIndex(SnapshotPtr->GetHistoryIndex());
 
-	TextSegment* s = CurrentSegment;
-
-	if (dataPos < CurrentHistoryPosition)
+	//The last active segment starting at or before the position.
+	auto next = std::upper_bound(Segments.begin(), Segments.end(), dataPos,
+		[](std::size_t pos, const ChangedSegment& c)
 	{
-		//Backward
-		std::size_t move = CurrentHistoryPosition - dataPos;
-
-		if (CurrentOffsetInSegment > move)
+		return pos < c.HistoryPosition;
+	});
+	std::size_t currentPos = dataPos;
+	if (next != Segments.begin())
+	{
+		const ChangedSegment& c = *(next - 1);
+		std::size_t offset = dataPos - c.HistoryPosition;
+		if (offset < c.HistoryLength)
 		{
-			//Within the same segment
-			CurrentOffsetInSegment -= move;
-			return;
+			return { c.Segment, c.Segment->ConvertSnapshotPosition(sid, offset, dir) };
 		}
+		currentPos = c.DataPosition + c.Segment->GetCurrentLength() + (offset - c.HistoryLength);
+	}
+	return doc->SegmentTree.ConvertPositionFromD({ currentPos });
+}
 
-		//Scan backwards
-		s = s->GetPreviousSegment();
-		move -= CurrentOffsetInSegment;
+void Mimi::SnapshotPositionConverter::Convert(const std::size_t* dataPos, const int* dir,
+	std::size_t count, DocumentPositionS* result)
+{
+	TextDocument* doc = SnapshotPtr->GetDocument();
+	Validate();
+	std::size_t sid = doc->ConvertSnapshotToIndex(SnapshotPtr->GetHistoryIndex());
+	TextSegmentTreeFinger finger(&doc->SegmentTree);
 
-		std::size_t hlen = s->GetHistoryLength(sid);
-		while (move > hlen)
-		{
-			move -= hlen;
-			s = s->GetPreviousSegment();
-			hlen = s->GetHistoryLength(sid);
-		}
-		CurrentSegment = s;
-		CurrentOffsetInSegment = hlen - move;
-	}
-	else
+	std::size_t next = 0; //First active segment after the position.
+	std::size_t i = 0;
+	while (i < count)
 	{
-		//Forward
-		std::size_t move = dataPos - CurrentHistoryPosition;
-
-		std::size_t hlen = s->GetHistoryLength(sid);
-		if (move < hlen - CurrentOffsetInSegment)
+		assert(i == 0 || dataPos[i - 1] <= dataPos[i]);
+		while (next < Segments.size() && Segments[next].HistoryPosition <= dataPos[i])
 		{
-			//Within the same segment
-			CurrentOffsetInSegment += move;
+			next += 1;
 		}
-
-		//Scan forward
-		s = s->GetNextSegment();
-		move -= hlen - CurrentOffsetInSegment;
-		hlen = s->GetHistoryLength(sid);
-		while (move > hlen)
+		std::size_t currentPos = dataPos[i];
+		if (next > 0)
 		{
-			move -= hlen;
-			s = s->GetNextSegment();
-			hlen = s->GetHistoryLength(sid);
+			const ChangedSegment& c = Segments[next - 1];
+			std::size_t offset = dataPos[i] - c.HistoryPosition;
+			if (offset < c.HistoryLength)
+			{
+				//All positions in this segment.
+				std::size_t end = i;
+				SegmentOffsets.clear();
+				while (end < count && dataPos[end] - c.HistoryPosition < c.HistoryLength)
+				{
+					SegmentOffsets.push_back(dataPos[end] - c.HistoryPosition);
+					end += 1;
+				}
+				c.Segment->ConvertSnapshotPositions(sid, SegmentOffsets.data(), &dir[i], end - i);
+				for (std::size_t j = i; j < end; ++j)
+				{
+					result[j] = { c.Segment, SegmentOffsets[j - i] };
+				}
+				i = end;
+				continue;
+			}
+			currentPos = c.DataPosition + c.Segment->GetCurrentLength() + (offset - c.HistoryLength);
 		}
-		CurrentSegment = s;
-		CurrentOffsetInSegment = move;
+		result[i] = finger.ConvertPositionFromD({ currentPos });
+		i += 1;
 	}
 }
@@ -1,16 +1,31 @@
 #pragma once
 #include "TextDocumentPosition.h"
 #include <cstddef>
+#include <vector>
 
 namespace Mimi
 {
 	class Snapshot;
 	class TextSegment;
 
+	//Convert positions in a snapshot to the current document. Only segments
+	//changed since the snapshot (active segments) can have a different length
+	//in the snapshot, and other parts of the document map to the same data
+	//positions after shifting. The converter keeps the active segments in
+	//document order with their positions in both, so that a conversion is a
+	//binary search followed by a position lookup in the segment tree.
 	class SnapshotPositionConverter final
 	{
 		friend class Snapshot;
 
+		struct ChangedSegment
+		{
+			TextSegment* Segment;
+			std::size_t DataPosition;
+			std::size_t HistoryPosition;
+			std::size_t HistoryLength;
+		};
+
 	public:
 		SnapshotPositionConverter(Snapshot* s);
 		SnapshotPositionConverter(const SnapshotPositionConverter&) = delete;
@@ -20,18 +35,26 @@ namespace Mimi
 
 	private:
 		Snapshot* SnapshotPtr;
-		std::size_t CurrentHistoryPosition;
-		TextSegment* CurrentSegment;
-		std::size_t CurrentOffsetInSegment;
+		std::size_t Version; //Of the segment tree when Segments was built.
+		bool Valid;
+		std::vector<ChangedSegment> Segments;
+		std::vector<TextSegment*> ActiveSegments;
+		std::vector<std::size_t> SegmentOffsets; //Used by batch conversion.
 
 	public:
-		//Init refreshes the internal reference to the TextSegment, which can change (delete,
-		//merge, etc.) if document is modified. So if possible change happens, before calling
-		//Convert, the caller must call Init.
+		//Init builds the index of the active segments in O(a log n). It's called
+		//by Convert when the document has been modified since the last time.
 		void Init();
+		//Deleted positions (dir 0) are returned with Position set to
+		//ModificationTracer::PositionDeleted.
 		DocumentPositionS Convert(std::size_t dataPos, int dir);
+		//Convert positions sorted in ascending order in one pass. Positions in
+		//the same segment are converted together by its tracer, and others are
+		//found with a finger from the previous one.
+		void Convert(const std::size_t* dataPos, const int* dir, std::size_t count,
+			DocumentPositionS* result);
 
 	private:
-		void Seek(std::size_t dataPos);
+		void Validate();
 	};
 }
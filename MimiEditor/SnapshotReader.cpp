@@ -1,6 +1,37 @@
 #include "SnapshotReader.h"
 #include "Buffer.h"
 #include "Snapshot.h"
+#include "BlockCompression.h"
+
+const std::uint8_t* Mimi::SnapshotRangeDecoder::GetData(const StaticBufferRange& range)
+{
+	if (!range.Compressed)
+	{
+		return &range.Buffer.GetRawData()[range.Offset];
+	}
+	if (DecodedSource.IsNull() || DecodedSource.GetRawData() != range.Buffer.GetRawData())
+	{
+		DecodedSource.TryClearRef();
+		Decoded.TryClearRef();
+		DecodedSource = range.Buffer.NewRef();
+		Decoded = BlockCompression::DecodeBlock(DecodedSource);
+	}
+	return &Decoded.GetRawData()[range.Offset];
+}
+
+Mimi::SnapshotReader::SnapshotReader(Snapshot* snapshot)
+	: SnapshotPtr(snapshot)
+{
+	AbsPosition = BufferOffset = 0;
+	Buffer.Reset(snapshot->Root);
+}
+
+bool Mimi::SnapshotReader::Reset()
+{
+	AbsPosition = BufferOffset = 0;
+	Buffer.Reset(SnapshotPtr->Root);
+	return true;
+}
 
 std::size_t Mimi::SnapshotReader::GetSize()
 {
@@ -9,29 +40,28 @@ std::size_t Mimi::SnapshotReader::GetSize()
 
 bool Mimi::SnapshotReader::Read(std::uint8_t* buffer, std::size_t bufferLen, std::size_t* numRead)
 {
-	assert(BufferIndex < SnapshotPtr->BufferList.size());
-	StaticBuffer src = SnapshotPtr->BufferList[BufferIndex];
-	assert(src.GetSize() >= BufferOffset);
+	StaticBufferRange src = Buffer.Get();
+	assert(src.Length >= BufferOffset);
 	std::size_t numReadVal = 0;
 	std::uint8_t* bufferPtr = buffer;
 	while (numReadVal < bufferLen)
 	{
-		if (src.GetSize() == BufferOffset)
+		if (src.Length == BufferOffset)
 		{
-			if (BufferIndex == SnapshotPtr->BufferList.size() - 1)
+			if (!Buffer.MoveNext())
 			{
 				break;
 			}
-			BufferIndex += 1;
 			BufferOffset = 0;
-			src = SnapshotPtr->BufferList[BufferIndex];
+			src = Buffer.Get();
+			continue;
 		}
-		std::size_t canRead = src.GetSize() - BufferOffset;
+		std::size_t canRead = src.Length - BufferOffset;
 		if (canRead > bufferLen - numReadVal)
 		{
 			canRead = bufferLen - numReadVal;
 		}
-		std::memcpy(bufferPtr, &src.GetRawData()[BufferOffset], canRead);
+		std::memcpy(bufferPtr, &Decoder.GetData(src)[BufferOffset], canRead);
 		bufferPtr += canRead;
 		numReadVal += canRead;
 		BufferOffset += canRead;
@@ -46,30 +76,115 @@ bool Mimi::SnapshotReader::Read(std::uint8_t* buffer, std::size_t bufferLen, std
 
 bool Mimi::SnapshotReader::Skip(std::size_t num)
 {
-	assert(BufferIndex < SnapshotPtr->BufferList.size());
-	StaticBuffer src = SnapshotPtr->BufferList[BufferIndex];
-	assert(src.GetSize() >= BufferOffset);
-	std::size_t numSkip = 0;
-	while (numSkip < num)
+	StaticBufferRange src = Buffer.Get();
+	assert(src.Length >= BufferOffset);
+	if (num <= src.Length - BufferOffset)
 	{
-		if (src.GetSize() == BufferOffset)
-		{
-			if (BufferIndex == SnapshotPtr->BufferList.size() - 1)
-			{
-				return false;
-			}
-			BufferIndex += 1;
-			BufferOffset = 0;
-			src = SnapshotPtr->BufferList[BufferIndex];
-		}
-		std::size_t canSkip = src.GetSize() - BufferOffset;
-		if (canSkip > num - numSkip)
+		BufferOffset += num;
+		AbsPosition += num;
+		return true;
+	}
+	//Find the buffer from the root instead of walking through the buffers.
+	std::size_t size = GetSize();
+	if (num > size - AbsPosition)
+	{
+		Seek(size);
+		return false;
+	}
+	return Seek(AbsPosition + num);
+}
+
+bool Mimi::SnapshotReader::Seek(std::size_t offset)
+{
+	if (offset > GetSize())
+	{
+		return false;
+	}
+	BufferOffset = Buffer.Seek(SnapshotPtr->Root, offset);
+	AbsPosition = offset;
+	return true;
+}
+
+const std::uint8_t* Mimi::SnapshotReader::GetChunkAt(std::size_t offset, std::size_t* chunkLength)
+{
+	if (!Seek(offset))
+	{
+		*chunkLength = 0;
+		return nullptr;
+	}
+	const StaticBufferRange& src = Buffer.Get();
+	*chunkLength = src.Length - BufferOffset;
+	return &Decoder.GetData(src)[BufferOffset];
+}
+
+Mimi::SnapshotChunkIterator::SnapshotChunkIterator(Snapshot* snapshot)
+	: Started(false), Data(nullptr), Length(0), Position(0)
+{
+	Buffer.Reset(snapshot->Root);
+}
+
+bool Mimi::SnapshotChunkIterator::MoveNext()
+{
+	if (!Started)
+	{
+		Started = true;
+	}
+	else
+	{
+		std::size_t next = Position + Length;
+		if (!Buffer.MoveNext())
 		{
-			canSkip = num - numSkip;
+			return false;
 		}
-		numSkip += canSkip;
-		BufferOffset += canSkip;
-		AbsPosition += canSkip;
+		Position = next;
+	}
+	const StaticBufferRange& range = Buffer.Get();
+	Data = Decoder.GetData(range);
+	Length = range.Length;
+	return true;
+}
+
+Mimi::SnapshotLineIterator::SnapshotLineIterator(Snapshot* snapshot)
+	: Ended(false), Data(nullptr), Length(0), Position(0),
+		Line(static_cast<std::size_t>(-1)) //Increased to 0 by the first MoveNext.
+{
+	Buffer.Reset(snapshot->Root);
+}
+
+bool Mimi::SnapshotLineIterator::MoveNext()
+{
+	if (Ended)
+	{
+		return false;
+	}
+	//The cursor is at the first buffer of the line. Only the flag of the
+	//following buffers is checked before the data is used, so that a
+	//decoded block is not replaced by the next one.
+	Position += Length;
+	Line += 1;
+	const StaticBufferRange& first = Buffer.Get();
+	assert(!first.Continuous);
+	const std::uint8_t* data = Decoder.GetData(first);
+	std::size_t length = first.Length;
+	bool more = Buffer.MoveNext();
+	if (!more || !Buffer.Get().Continuous)
+	{
+		Data = data;
+		Length = length;
+		Ended = !more;
+		return true;
+	}
+
+	Joined.assign(data, data + length);
+	while (more && Buffer.Get().Continuous)
+	{
+		const StaticBufferRange& range = Buffer.Get();
+		const std::uint8_t* rangeData = Decoder.GetData(range);
+		Joined.insert(Joined.end(), rangeData, rangeData + range.Length);
+		more = Buffer.MoveNext();
 	}
+	Data = Joined.data();
+	Length = Joined.size();
+	Ended = !more;
 	return true;
 }
@@ -1,46 +1,168 @@
 #pragma once
 #include "File.h"
+#include "Buffer.h"
+#include "SnapshotNode.h"
+#include <vector>
 
 namespace Mimi
 {
 	class Snapshot;
 
+	//Data of the ranges in a snapshot. Keeps the last decoded compressed block
+	//(instead of the document cache) so that snapshots can be read from other
+	//threads.
+	class SnapshotRangeDecoder final
+	{
+	public:
+		SnapshotRangeDecoder()
+		{
+			DecodedSource.Clear();
+			Decoded.Clear();
+		}
+		SnapshotRangeDecoder(const SnapshotRangeDecoder&) = delete;
+		SnapshotRangeDecoder(SnapshotRangeDecoder&&) = delete;
+		SnapshotRangeDecoder& operator= (const SnapshotRangeDecoder&) = delete;
+		~SnapshotRangeDecoder()
+		{
+			DecodedSource.TryClearRef();
+			Decoded.TryClearRef();
+		}
+
+	private:
+		StaticBuffer DecodedSource;
+		StaticBuffer Decoded;
+
+	public:
+		//Data of a compressed range is valid until another block is decoded.
+		const std::uint8_t* GetData(const StaticBufferRange& range);
+	};
+
 	class SnapshotReader final
 	{
 		friend class Snapshot;
 
 	public:
-		SnapshotReader(Snapshot* snapshot)
-			: SnapshotPtr(snapshot)
-		{
-			AbsPosition = BufferIndex = BufferOffset = 0;
-		}
+		SnapshotReader(Snapshot* snapshot);
 		SnapshotReader(const SnapshotReader&) = delete;
 		SnapshotReader(SnapshotReader&&) = delete;
 		SnapshotReader& operator= (const SnapshotReader&) = delete;
-		~SnapshotReader() {}
 
 	private:
 		Snapshot* SnapshotPtr;
 		std::size_t AbsPosition;
-		std::size_t BufferIndex;
+		SnapshotBufferCursor Buffer;
 		std::size_t BufferOffset;
+		SnapshotRangeDecoder Decoder;
 
 	public:
 		std::size_t GetSize();
 
 		bool Read(std::uint8_t* buffer, std::size_t bufferLen, std::size_t* numRead);
 		bool Skip(std::size_t num);
+		//Move to an absolute position in O(log n). Return false (and stay) if
+		//it's after the end.
+		bool Seek(std::size_t offset);
+		//Move to the offset and return the data from it to the end of the
+		//containing buffer without copying (length in chunkLength, 0 at the
+		//end). The data is valid until the reader reads another buffer.
+		const std::uint8_t* GetChunkAt(std::size_t offset, std::size_t* chunkLength);
 
-		bool Reset()
+		bool Reset();
+
+		std::size_t GetPosition()
 		{
-			AbsPosition = BufferIndex = BufferOffset = 0;
-			return true;
+			return AbsPosition;
 		}
+	};
+
+	//Iterate the buffers of a snapshot without copying. Buffers of the
+	//snapshot are immutable, so the data is valid while the snapshot is alive,
+	//except for compressed ones (valid until the next call to MoveNext).
+	//Empty buffers are also returned.
+	class SnapshotChunkIterator final
+	{
+	public:
+		SnapshotChunkIterator(Snapshot* snapshot);
+		SnapshotChunkIterator(const SnapshotChunkIterator&) = delete;
+		SnapshotChunkIterator(SnapshotChunkIterator&&) = delete;
+		SnapshotChunkIterator& operator= (const SnapshotChunkIterator&) = delete;
 
+	private:
+		SnapshotBufferCursor Buffer;
+		SnapshotRangeDecoder Decoder;
+		bool Started;
+		const std::uint8_t* Data;
+		std::size_t Length;
+		std::size_t Position;
+
+	public:
+		//Move to the first (on the first call) or the next chunk. Return false
+		//at the end.
+		bool MoveNext();
+
+		const std::uint8_t* GetData()
+		{
+			return Data;
+		}
+
+		std::size_t GetLength()
+		{
+			return Length;
+		}
+
+		//Offset of the chunk in the snapshot.
 		std::size_t GetPosition()
 		{
-			return AbsPosition;
+			return Position;
+		}
+	};
+
+	//Iterate the lines (including the line break) of a snapshot. A line in a
+	//single buffer is returned without copying (see SnapshotChunkIterator).
+	//Only lines split into continuous segments are copied into the iterator,
+	//and are valid until the next call to MoveNext.
+	class SnapshotLineIterator final
+	{
+	public:
+		SnapshotLineIterator(Snapshot* snapshot);
+		SnapshotLineIterator(const SnapshotLineIterator&) = delete;
+		SnapshotLineIterator(SnapshotLineIterator&&) = delete;
+		SnapshotLineIterator& operator= (const SnapshotLineIterator&) = delete;
+
+	private:
+		SnapshotBufferCursor Buffer;
+		SnapshotRangeDecoder Decoder;
+		bool Ended;
+		std::vector<std::uint8_t> Joined;
+		const std::uint8_t* Data;
+		std::size_t Length;
+		std::size_t Position;
+		std::size_t Line;
+
+	public:
+		//Move to the first (on the first call) or the next line. Return false
+		//at the end.
+		bool MoveNext();
+
+		const std::uint8_t* GetData()
+		{
+			return Data;
+		}
+
+		std::size_t GetLength()
+		{
+			return Length;
+		}
+
+		//Offset of the line in the snapshot.
+		std::size_t GetPosition()
+		{
+			return Position;
+		}
+
+		std::size_t GetLineIndex()
+		{
+			return Line;
 		}
 	};
 
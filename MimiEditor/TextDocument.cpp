@@ -2,66 +2,272 @@
 #include "Snapshot.h"
 #include "TextSegment.h"
 #include "FileTypeDetector.h"
+#include <algorithm>
 
 Mimi::TextDocument::~TextDocument()
 {
+	DisposeQueuedSnapshots();
 	assert(SnapshotInUse.GetCount() == 0);
-	//Let the TextSegmentTree delete itself.
+	//Let the TextSegmentTree delete itself. Arenas are released after that.
+}
+
+void Mimi::TextDocument::DeleteSegment(TextSegment* s)
+{
+	if (s->ActiveData)
+	{
+		DeleteActiveData(s->ActiveData);
+		s->ActiveData = nullptr;
+	}
+	SegmentArena.Delete(s);
+}
+
+void Mimi::TextDocument::DeleteActiveData(ActiveTextSegmentData* a)
+{
+	if (a->PreviousActive)
+	{
+		a->PreviousActive->NextActive = a->NextActive;
+	}
+	else
+	{
+		assert(FirstActive == a);
+		FirstActive = a->NextActive;
+	}
+	if (a->NextActive)
+	{
+		a->NextActive->PreviousActive = a->PreviousActive;
+	}
+	ActiveDataArena.Delete(a);
+}
+
+std::size_t Mimi::TextDocument::DeactivateSegments(std::uint32_t time)
+{
+	if (SnapshotCount != 0) return 0;
+	std::size_t ret = 0;
+	ActiveTextSegmentData* a = FirstActive;
+	while (a)
+	{
+		//Save the next one: a is deleted if the segment is made inactive.
+		ActiveTextSegmentData* next = a->NextActive;
+		TextSegment* s = a->Segment;
+		s->CheckAndMakeInactive(time);
+		if (!s->IsActive())
+		{
+			ret += 1;
+		}
+		a = next;
+	}
+	return ret;
+}
+
+void Mimi::TextDocument::GetActiveSegments(std::vector<TextSegment*>& result)
+{
+	std::vector<std::pair<std::size_t, TextSegment*>> segments;
+	for (ActiveTextSegmentData* a = FirstActive; a; a = a->NextActive)
+	{
+		segments.push_back({ SegmentTree.GetElementIndex(a->Segment), a->Segment });
+	}
+	std::sort(segments.begin(), segments.end());
+	result.clear();
+	for (auto&& s : segments)
+	{
+		result.push_back(s.second);
+	}
 }
 
 Mimi::Snapshot* Mimi::TextDocument::CreateSnapshot()
 {
-	bool resize = false;
+	DisposeQueuedSnapshots();
 	if (++SnapshotCount > SnapshotCapacity)
 	{
 		SnapshotCapacity *= 2;
-		resize = true;
+		SnapshotCapacityEpoch += 1;
 	}
 	SnapshotInUse.Insert(0, true);
 
 	Snapshot* s = new Snapshot(this, NextSnapshotIndex++);
 
-	TextSegment* segment = this->SegmentTree.GetFirstSegment();
-	assert(segment);
+	//Segments start tracing the new snapshot (and resize their tracers) when
+	//they are used next time (see TextSegment::UpdateTracer).
 
-	s->DataLength = 0;
-	do
-	{
-		StaticBuffer buffer = segment->MakeSnapshot(resize);
-		s->DataLength += buffer.GetSize();
-		s->AppendBuffer(buffer.MoveRef());
-		segment = segment->GetNextSegment();
-	} while (segment);
+	//Only nodes changed since the last snapshot are copied.
+	s->Root = SegmentTree.MakeSnapshotNode();
+	s->DataLength = s->Root->GetDataLength();
+	SnapshotBytes += s->DataLength;
 
 	return s;
 }
 
 void Mimi::TextDocument::DisposeSnapshot(Snapshot* s)
+{
+	ReleaseSnapshot(s);
+	TrimSnapshots();
+}
+
+std::size_t Mimi::TextDocument::DisposeQueuedSnapshots()
+{
+	std::vector<Snapshot*> queued;
+	{
+		std::lock_guard<std::mutex> lock(QueuedSnapshotsLock);
+		if (QueuedSnapshots.empty())
+		{
+			return 0;
+		}
+		queued.swap(QueuedSnapshots);
+	}
+	for (Snapshot* s : queued)
+	{
+		ReleaseSnapshot(s);
+		s->Document = nullptr; //Already disposed.
+		delete s;
+	}
+	TrimSnapshots();
+	return queued.size();
+}
+
+void Mimi::TextDocument::QueueDisposeSnapshot(Snapshot* s)
+{
+	std::lock_guard<std::mutex> lock(QueuedSnapshotsLock);
+	QueuedSnapshots.push_back(s);
+}
+
+void Mimi::TextDocument::ReleaseSnapshot(Snapshot* s)
 {
 	assert(static_cast<TextDocument*>(s->GetDocument()) == this);
-	std::size_t id = ConvertSnapshotToIndex(s->GetHistoryIndex());
-	const bool resize = false; //Never resize
+	SnapshotInUse[ConvertSnapshotToIndex(s->GetHistoryIndex())] = false;
+	SnapshotBytes -= s->DataLength;
+	SnapshotNodeBytes -= s->ClearBuffer();
+}
 
-	//Update in use array.
-	SnapshotInUse[id] = false;
+void Mimi::TextDocument::TrimSnapshots()
+{
 	std::size_t lastUsed;
-	for (lastUsed = SnapshotInUse.GetCount() - 1; lastUsed-- > 0; )
+	for (lastUsed = SnapshotInUse.GetCount(); lastUsed-- > 0; )
 	{
 		if (SnapshotInUse[lastUsed]) break;
 	}
 	std::size_t disposeNum = SnapshotInUse.GetCount() - lastUsed - 1;
 	SnapshotInUse.RemoveRange(lastUsed + 1, disposeNum);
+	SnapshotCount = lastUsed + 1;
+	//Tracers are not changed: disposed snapshots are the last ones in them.
 
-	//Dispose on each segment.
-	TextSegment* segment = SegmentTree.GetFirstSegment();
-	assert(segment);
-	do
+	//Shrink the capacity after a burst of snapshots. Unlike growing, this is
+	//done for all active segments now to release the memory.
+	std::size_t capacity = SnapshotCapacity;
+	while (capacity > InitialSnapshotCapacity && SnapshotCount * 4 <= capacity)
+	{
+		capacity /= 2;
+	}
+	if (capacity != SnapshotCapacity)
 	{
-		segment->DisposeSnapshot(lastUsed + 1, resize);
-		segment = segment->GetNextSegment();
-	} while (segment);
+		SnapshotCapacity = capacity;
+		SnapshotCapacityEpoch += 1;
+		for (ActiveTextSegmentData* a = FirstActive; a; a = a->NextActive)
+		{
+			a->Segment->UpdateTracer();
+		}
+	}
+}
 
-	s->ClearBuffer();
+Mimi::DocumentMemoryUsage Mimi::TextDocument::GetMemoryUsage()
+{
+	DocumentMemoryUsage ret;
+	ret.SegmentCount = SegmentArena.GetLiveCount();
+	ret.SegmentBytes = SegmentArena.GetReservedSize();
+	ret.NodeCount = NodeArena.GetLiveCount();
+	ret.NodeBytes = NodeArena.GetReservedSize();
+
+	ret.ActiveSegmentCount = ActiveDataArena.GetLiveCount();
+	ret.ActiveDataBytes = ActiveDataArena.GetReservedSize();
+	ret.InactiveSegmentCount = ret.SegmentCount - ret.ActiveSegmentCount;
+	ret.InactiveContentBytes = InactiveContentBytes;
+	ret.ActiveContentCapacity = ActiveContentCapacity;
+	ret.ActiveContentLength = SegmentTree.GetDataLength() - InactiveContentBytes -
+		CompressedContentLength - InternedContentLength - InlineContentLength;
+	ret.InlineSegmentCount = InlineSegmentCount;
+	ret.InlineContentLength = InlineContentLength;
+
+	ret.CompressedSegmentCount = CompressedSegmentCount;
+	ret.CompressedContentBytes = CompressedContentBytes;
+	ret.CompressedContentLength = CompressedContentLength;
+	ret.DecodedBlockBytes = BlockCache.GetMemorySize();
+
+	ret.InternedSegmentCount = InternedSegmentCount;
+	ret.InternedContentLength = InternedContentLength;
+	ret.InternedContentBytes = InternTable.GetContentBytes();
+	ret.InternTableBytes = InternTable.GetTableBytes();
+
+	ret.TracerBytes = TracerBytes;
+	ret.LabelBytes = LabelBytes;
+
+	ret.SnapshotCount = SnapshotCount;
+	ret.SnapshotBytes = SnapshotBytes;
+	ret.SnapshotNodeBytes = SnapshotNodeBytes;
+
+	ret.EventHandlerCount = LabelOwnerChanged.GetHandlerCount() + LabelRemoved.GetHandlerCount();
+	ret.EventHandlerBytes = LabelOwnerChanged.GetMemorySize() + LabelRemoved.GetMemorySize();
+	return ret;
+}
+
+Mimi::DocumentMemoryUsage Mimi::TextDocument::CollectMemoryUsage()
+{
+	DocumentMemoryUsage ret = GetMemoryUsage();
+	ret.NodeCount = SegmentTree.CountNodes();
+	ret.SegmentCount = 0;
+	ret.ActiveSegmentCount = ret.InactiveSegmentCount = 0;
+	ret.InactiveContentBytes = 0;
+	ret.CompressedSegmentCount = ret.CompressedContentBytes = ret.CompressedContentLength = 0;
+	ret.InternedSegmentCount = ret.InternedContentLength = 0;
+	ret.InlineSegmentCount = ret.InlineContentLength = 0;
+	ret.ActiveContentCapacity = ret.ActiveContentLength = 0;
+	ret.TracerBytes = ret.LabelBytes = 0;
+
+	TextSegment* s = SegmentTree.GetFirstSegment();
+	while (s)
+	{
+		ret.SegmentCount += 1;
+		if (s->IsActive())
+		{
+			ret.ActiveSegmentCount += 1;
+			assert(s->ActiveData->Segment == s);
+			ret.ActiveContentCapacity += s->ActiveData->ContentBuffer.GetMemorySize();
+			ret.ActiveContentLength += s->ActiveData->ContentBuffer.GetLength();
+			ret.TracerBytes += s->ActiveData->Modifications.GetMemorySize();
+		}
+		else
+		{
+			ret.InactiveSegmentCount += 1;
+			if (s->Inline)
+			{
+				ret.InlineSegmentCount += 1;
+				ret.InlineContentLength += s->InlineLength;
+			}
+			else if (s->Compressed)
+			{
+				ret.CompressedSegmentCount += 1;
+				ret.CompressedContentLength += s->CompressedLength;
+				ret.CompressedContentBytes += s->CompressedLength * s->ContentBuffer.GetSize() /
+					BlockCompression::GetDecodedSize(s->ContentBuffer);
+			}
+			else if (s->Interned)
+			{
+				ret.InternedSegmentCount += 1;
+				ret.InternedContentLength += s->ContentBuffer.GetSize();
+			}
+			else
+			{
+				ret.InactiveContentBytes += s->ContentBuffer.GetSize();
+			}
+		}
+		ret.LabelBytes += s->Labels.GetHeapSize();
+		s = s->GetNextSegment();
+	}
+	std::size_t listed = 0;
+	for (ActiveTextSegmentData* a = FirstActive; a; a = a->NextActive)
+	{
+		listed += 1;
+	}
+	assert(listed == ret.ActiveSegmentCount);
+	return ret;
 }
 
 Mimi::DocumentLabelIndex Mimi::TextDocument::AddPointLabel(std::uint16_t handler, 
@@ -300,7 +506,7 @@ Mimi::DocumentPositionS Mimi::TextDocument::DeleteRange(std::uint32_t time,
 			assert(checkRemoved == s);
 
 			//Release memory.
-			delete s;
+			DeleteSegment(s);
 
 			g.Position += len;
 			s = next;
@@ -407,29 +613,44 @@ void Mimi::TextDocument::Insert(std::uint32_t time, DocumentPositionS pos, Dynam
 
 Mimi::TextDocument * Mimi::TextDocument::CreateEmpty(CodePage cp)
 {
-	TextSegment* s = new TextSegment(false, false, ModifiedFlag::NotModified);
+	TextDocument* doc = new TextDocument();
+	doc->TextEncoding = cp;
+
+	TextSegment* s = doc->NewSegment(false, false, ModifiedFlag::NotModified);
 	s->ContentBuffer = StaticBuffer::CreateEmpty();
+	doc->SegmentTree.InsertFirst(s);
 
-	TextDocument* doc = new TextDocument(s);
-	doc->TextEncoding = cp;
 	return doc;
 }
 
-Mimi::TextDocument* Mimi::TextDocument::CreateFromTextFile(FileTypeDetector* file)
+Mimi::TextDocument* Mimi::TextDocument::CreateFromTextFile(FileTypeDetector* file, bool deduplicate)
 {
-	assert(file->ReadNextLine());
+	bool hasFirstLine = file->ReadNextLine();
+	assert(hasFirstLine);
 	assert(!file->IsCurrentLineContinuous());
-	TextSegment* first = new TextSegment(file->CurrentLineData,
-		false, file->IsCurrentLineUnfinished(), ModifiedFlag::NotModified);
-
-	TextDocument* doc = new TextDocument(first);
+	TextDocument* doc = new TextDocument();
 	doc->TextEncoding = file->GetCodePage();
+	doc->DeduplicationEnabled = deduplicate;
+
+	TextSegment* s = doc->NewSegment(file->CurrentLineData,
+		false, file->IsCurrentLineUnfinished(), ModifiedFlag::NotModified);
+	if (deduplicate)
+	{
+		//Not in the tree yet. Counted when inserted.
+		s->Intern(doc->InternTable);
+	}
+	doc->SegmentTree.InsertFirst(s);
 
 	while (file->ReadNextLine())
 	{
-		doc->SegmentTree.FastAppend(new TextSegment(file->CurrentLineData,
-			file->IsCurrentLineUnfinished(),
-			file->IsCurrentLineContinuous(), ModifiedFlag::NotModified));
+		s = doc->NewSegment(file->CurrentLineData,
+			file->IsCurrentLineContinuous(),
+			file->IsCurrentLineUnfinished(), ModifiedFlag::NotModified);
+		if (deduplicate)
+		{
+			s->Intern(doc->InternTable);
+		}
+		doc->SegmentTree.FastAppend(s);
 	}
 	doc->SegmentTree.UpdataAllCount();
 
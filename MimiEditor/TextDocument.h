@@ -1,11 +1,18 @@
 #pragma once
 #include "EventHandler.h"
 #include "TextSegmentList.h"
+#include "TextSegment.h"
+#include "ObjectArena.h"
 #include "ShortVector.h"
 #include "CodePage.h"
 #include "Clock.h"
+#include "BlockCompression.h"
+#include "BufferInternTable.h"
 #include <cstdint>
 #include <cstddef>
+#include <utility>
+#include <vector>
+#include <mutex>
 
 namespace Mimi
 {
@@ -54,13 +61,88 @@ namespace Mimi
 		}
 	};
 
+	//Memory used by a TextDocument (bytes and object counts by category).
+	struct DocumentMemoryUsage
+	{
+		//Segments and tree nodes (reserved arena memory).
+		std::size_t SegmentCount;
+		std::size_t SegmentBytes;
+		std::size_t NodeCount;
+		std::size_t NodeBytes;
+
+		//Content of inactive segments (StaticBuffer). The count includes
+		//compressed, interned and inline segments.
+		std::size_t InactiveSegmentCount;
+		std::size_t InactiveContentBytes;
+
+		//Short inactive content stored in the segments (part of SegmentBytes).
+		std::size_t InlineSegmentCount;
+		std::size_t InlineContentLength;
+
+		//Compressed segments. Bytes is each segment's share of its block;
+		//Length is the decoded length.
+		std::size_t CompressedSegmentCount;
+		std::size_t CompressedContentBytes;
+		std::size_t CompressedContentLength;
+		std::size_t DecodedBlockBytes;
+
+		//Interned (deduplicated) segments. Length is the total content length of
+		//these segments; Bytes is the unique content in the intern table.
+		std::size_t InternedSegmentCount;
+		std::size_t InternedContentLength;
+		std::size_t InternedContentBytes;
+		std::size_t InternTableBytes;
+
+		//Active segments: ActiveTextSegmentData (reserved arena memory) and the
+		//content (DynamicBuffer, allocated and used).
+		std::size_t ActiveSegmentCount;
+		std::size_t ActiveDataBytes;
+		std::size_t ActiveContentCapacity;
+		std::size_t ActiveContentLength;
+
+		//Snapshot lists in ModificationTracer of active segments.
+		std::size_t TracerBytes;
+
+		//Label arrays of all segments.
+		std::size_t LabelBytes;
+
+		//Buffers referenced by snapshots in use. They may be shared with segments.
+		std::size_t SnapshotCount;
+		std::size_t SnapshotBytes;
+
+		//Snapshot nodes (see SnapshotNode), cached by the tree or used by
+		//snapshots. Buffers are counted by the categories above.
+		std::size_t SnapshotNodeBytes;
+
+		//Event handler tables.
+		std::size_t EventHandlerCount;
+		std::size_t EventHandlerBytes;
+
+		std::size_t GetTotalBytes() const
+		{
+			return SegmentBytes + NodeBytes + InactiveContentBytes + CompressedContentBytes +
+				DecodedBlockBytes + InternedContentBytes + InternTableBytes + ActiveDataBytes +
+				ActiveContentCapacity + TracerBytes + LabelBytes + SnapshotNodeBytes + EventHandlerBytes;
+		}
+
+		//Logical size of interned content over its stored size.
+		double GetDedupRatio() const
+		{
+			if (InternedContentBytes == 0) return 1.0;
+			return static_cast<double>(InternedContentLength) / InternedContentBytes;
+		}
+	};
+
 	class TextDocument final
 	{
 		friend class TextSegment;
+		friend class TextSegmentList;
+		friend class TextSegmentTree;
+		friend class TextDocumentCompactor;
 
 	private:
-		TextDocument(TextSegment* firstSegment) //Use factory
-			: SegmentTree(this, firstSegment)
+		TextDocument() //Use factory
+			: SegmentTree(this)
 		{
 		}
 	public:
@@ -69,6 +151,13 @@ namespace Mimi
 		TextDocument& operator= (const TextDocument&) = delete;
 		virtual ~TextDocument();
 
+	private:
+		//Storage of segments and tree nodes. Declared before SegmentTree so that
+		//the tree is destroyed first and all blocks are then released at once.
+		ObjectArena<TextSegment> SegmentArena;
+		ObjectArena<ActiveTextSegmentData> ActiveDataArena;
+		ObjectArena<TextSegmentList> NodeArena;
+
 	public:
 		//Content access.
 		TextSegmentTree SegmentTree;
@@ -77,11 +166,45 @@ namespace Mimi
 
 	private:
 		std::size_t SnapshotCount = 0;
-		std::size_t SnapshotCapacity = 2;
+		static const std::size_t InitialSnapshotCapacity = 2;
+		std::size_t SnapshotCapacity = InitialSnapshotCapacity;
+		//Changed with SnapshotCapacity. Tracers are resized lazily when they
+		//are used next time (see TextSegment::UpdateTracer).
+		std::size_t SnapshotCapacityEpoch = 0;
 		std::size_t NextSnapshotIndex = 0;
 		ShortVector<bool> SnapshotInUse;
+		bool ThreadSafeSnapshot = false;
+		std::mutex QueuedSnapshotsLock;
+		std::vector<Snapshot*> QueuedSnapshots;
+		//Head of the list of active segments (see ActiveTextSegmentData).
+		ActiveTextSegmentData* FirstActive = nullptr;
+		bool CompressionEnabled = false;
+		bool DeduplicationEnabled = false;
+		bool CharacterCountEnabled = false;
 		std::uint16_t NextLabelHandlerIndex = 0;
 
+		//Decoded blocks of compressed segments, shared by all segments.
+		DecodedBlockCache BlockCache;
+		//Content shared by identical inactive segments.
+		BufferInternTable InternTable;
+
+	private:
+		//Memory counters. Updated by segments when they are inserted into or
+		//removed from the tree, and when their dynamic data changes.
+		std::size_t InactiveContentBytes = 0;
+		std::size_t ActiveContentCapacity = 0;
+		std::size_t TracerBytes = 0;
+		std::size_t LabelBytes = 0;
+		std::size_t SnapshotBytes = 0;
+		std::size_t SnapshotNodeBytes = 0;
+		std::size_t CompressedSegmentCount = 0;
+		std::size_t CompressedContentLength = 0;
+		std::size_t CompressedContentBytes = 0;
+		std::size_t InternedSegmentCount = 0;
+		std::size_t InternedContentLength = 0;
+		std::size_t InlineSegmentCount = 0;
+		std::size_t InlineContentLength = 0;
+
 	public:
 		std::uint32_t GetTime()
 		{
@@ -100,9 +223,83 @@ namespace Mimi
 			return SnapshotCapacity;
 		}
 
+		//When enabled, buffers of new snapshots can be referenced from other
+		//threads (e.g. by background workers). Reference counting of these
+		//buffers becomes atomic.
+		void SetThreadSafeSnapshot(bool value)
+		{
+			if (value && !ThreadSafeSnapshot)
+			{
+				//Cached nodes may contain buffers not marked.
+				SegmentTree.ReleaseSnapshotCache();
+			}
+			ThreadSafeSnapshot = value;
+		}
+
+		bool IsThreadSafeSnapshot()
+		{
+			return ThreadSafeSnapshot;
+		}
+
+		//When enabled, TextDocumentCompactor packs consecutive inactive segments
+		//into compressed blocks. They are decompressed when activated.
+		void SetCompressionEnabled(bool value)
+		{
+			CompressionEnabled = value;
+		}
+
+		bool IsCompressionEnabled()
+		{
+			return CompressionEnabled;
+		}
+
+		//When enabled, identical inactive segments share their content. Existing
+		//inactive segments are deduplicated by TextDocumentCompactor.
+		void SetDeduplicationEnabled(bool value)
+		{
+			DeduplicationEnabled = value;
+		}
+
+		bool IsDeduplicationEnabled()
+		{
+			return DeduplicationEnabled;
+		}
+
+		//When enabled, the segment tree also counts code points and UTF-16 code
+		//units, so that positions can be converted to and from character offsets
+		//(TextSegmentTree::ConvertPositionToC etc.).
+		void SetCharacterCountEnabled(bool value)
+		{
+			if (value && !CharacterCountEnabled)
+			{
+				CharacterCountEnabled = true;
+				SegmentTree.UpdataAllCount();
+			}
+			CharacterCountEnabled = value;
+		}
+
+		bool IsCharacterCountEnabled()
+		{
+			return CharacterCountEnabled;
+		}
+
 		Snapshot* CreateSnapshot();
 		void DisposeSnapshot(Snapshot* s);
 
+		//Snapshots released by other threads (Snapshot::QueueDispose). They are
+		//deleted in a batch by the document thread here (also called in
+		//CreateSnapshot). Return the number of snapshots deleted.
+		std::size_t DisposeQueuedSnapshots();
+		//Can be called from any thread.
+		void QueueDisposeSnapshot(Snapshot* s);
+
+	private:
+		void ReleaseSnapshot(Snapshot* s);
+		//Remove disposed snapshots at the end of the in-use array and shrink
+		//the capacity.
+		void TrimSnapshots();
+
+	public:
 		std::size_t ConvertSnapshotToIndex(std::size_t hindex)
 		{
 			return NextSnapshotIndex - hindex - 1;
@@ -127,6 +324,72 @@ namespace Mimi
 		void DeleteLabel(DocumentLabelIndex label);
 		//TODO move?
 
+	public:
+		//Memory accounting.
+		//Get the memory usage from counters (fast).
+		DocumentMemoryUsage GetMemoryUsage();
+		//Walk the whole document and calculate the exact memory usage (slow, for
+		//debug use). Snapshot and event handler are still from counters.
+		DocumentMemoryUsage CollectMemoryUsage();
+
+	private:
+		TextSegment* NewSegment(bool continuous, bool unfinished, ModifiedFlag modified)
+		{
+			return SegmentArena.New(continuous, unfinished, modified);
+		}
+
+		TextSegment* NewSegment(DynamicBuffer& buffer, bool continuous, bool unfinished,
+			ModifiedFlag modified)
+		{
+			return SegmentArena.New(buffer, continuous, unfinished, modified);
+		}
+
+		//Segment must have been removed from the tree.
+		void DeleteSegment(TextSegment* s);
+
+		//Allocate active data of the segment and link it into the active list.
+		template <typename... A>
+		ActiveTextSegmentData* NewActiveData(TextSegment* s, A&&... args)
+		{
+			ActiveTextSegmentData* ret = ActiveDataArena.New(std::forward<A>(args)...);
+			ret->Segment = s;
+			ret->NextActive = FirstActive;
+			if (FirstActive)
+			{
+				FirstActive->PreviousActive = ret;
+			}
+			FirstActive = ret;
+			return ret;
+		}
+
+		void DeleteActiveData(ActiveTextSegmentData* a);
+
+	public:
+		//Make inactive all active segments not modified since time (see
+		//TextSegment::CheckAndMakeInactive). Only active segments are visited.
+		//Return the number of segments made inactive.
+		std::size_t DeactivateSegments(std::uint32_t time);
+		//Active segments in document order. Only these segments can differ from
+		//the content in snapshots.
+		void GetActiveSegments(std::vector<TextSegment*>& result);
+
+	public:
+		//Edit transactions. Within a transaction, edits that only change text
+		//inside segments mark the tree leaves, and the counts are propagated to
+		//the root once on commit (instead of once for each edit). Queries still
+		//return up-to-date results: they update the counts first if necessary.
+		//Apply edits from the end to the beginning to avoid these updates.
+		//Transactions can be nested.
+		void BeginTransaction()
+		{
+			SegmentTree.BeginDeferCount();
+		}
+
+		void CommitTransaction()
+		{
+			SegmentTree.EndDeferCount();
+		}
+
 	public:
 		//Inter-segment modification.
 		DocumentPositionS DeleteRange(std::uint32_t time, DocumentPositionS begin, DocumentPositionS end);
@@ -135,6 +398,6 @@ namespace Mimi
 
 	public:
 		static TextDocument* CreateEmpty(CodePage cp);
-		static TextDocument* CreateFromTextFile(FileTypeDetector* file);
+		static TextDocument* CreateFromTextFile(FileTypeDetector* file, bool deduplicate = false);
 	};
 }
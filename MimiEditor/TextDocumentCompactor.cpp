@@ -0,0 +1,98 @@
+#include "TextDocumentCompactor.h"
+#include "TextDocument.h"
+#include "TextSegment.h"
+#include "BlockCompression.h"
+
+bool Mimi::TextDocumentCompactor::Run(std::uint32_t time, std::size_t milliSeconds)
+{
+	TextSegmentTree& tree = Document->SegmentTree;
+	const std::uint64_t start = Clock::GetTime();
+	const std::uint64_t budget = milliSeconds * Clock::GetMilliSecondLength();
+
+	do
+	{
+		if (NextElement >= tree.GetElementCount())
+		{
+			FlushBlock();
+			//Release content no longer used since last pass.
+			Document->InternTable.Purge();
+			NextElement = 0;
+			return true;
+		}
+
+		TextSegment* s = tree.GetSegmentWithElementIndex(NextElement);
+		TextSegmentList* leaf = s->GetParent();
+		do
+		{
+			s->Compact(time);
+			if (Document->CompressionEnabled)
+			{
+				AddToBlock(s);
+			}
+			NextElement += 1;
+			s = s->GetNextSegment();
+		} while (s && s->GetParent() == leaf);
+		//Merging does not change element indexes.
+		tree.CompactLeaf(leaf);
+	} while (Clock::GetTime() - start < budget);
+
+	//The document may be modified before the next call.
+	FlushBlock();
+	return false;
+}
+
+void Mimi::TextDocumentCompactor::AddToBlock(TextSegment* s)
+{
+	if (s->IsActive() || s->Compressed)
+	{
+		FlushBlock();
+		return;
+	}
+	if (s->Inline || s->Interned)
+	{
+		//Already stored in the segment or shared. Not worth compressing.
+		return;
+	}
+	std::size_t len = s->ContentBuffer.GetSize();
+	if (len == 0 || len > BlockCompression::MaxBlockSize)
+	{
+		//Empty or too long for a block.
+		return;
+	}
+	if (PendingLength + len > BlockCompression::MaxBlockSize)
+	{
+		FlushBlock();
+	}
+	PendingSegments.push_back(s);
+	PendingLength += len;
+}
+
+void Mimi::TextDocumentCompactor::FlushBlock()
+{
+	if (PendingSegments.size() == 0)
+	{
+		return;
+	}
+	BlockData.resize(PendingLength);
+	std::size_t offset = 0;
+	for (auto s : PendingSegments)
+	{
+		std::size_t len = s->ContentBuffer.GetSize();
+		std::memcpy(&BlockData[offset], s->ContentBuffer.GetRawData(), len);
+		offset += len;
+	}
+	StaticBuffer block = BlockCompression::MakeBlock(BlockData.data(), PendingLength);
+	if (!block.IsNull())
+	{
+		offset = 0;
+		for (auto s : PendingSegments)
+		{
+			std::size_t len = s->ContentBuffer.GetSize();
+			s->Compress(block, offset);
+			offset += len;
+		}
+		block.ClearRef();
+	}
+	PendingSegments.clear();
+	PendingLength = 0;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace Mimi
+{
+	class TextDocument;
+	class TextSegment;
+
+	//Incremental memory compaction of a TextDocument, to be run when the editor
+	//is idle. Each call to Run processes leaves of the segment tree until the
+	//time budget is used up, and the next call continues from there. For each
+	//segment it:
+	//  makes it inactive if it's not modified recently (and there's no snapshot),
+	//  shrinks the content buffer of active segments,
+	//  removes empty label slots at the end of the label array.
+	//Underfull leaves are merged with their neighbours.
+	//If compression is enabled in the document, runs of consecutive inactive
+	//segments are then packed into shared compressed blocks.
+	//If deduplication is enabled, inactive segments are interned, and unused
+	//entries of the intern table are purged at the end of each pass.
+	//Memory of segments and nodes stays in the arenas of the document and will
+	//be reused by later allocations.
+	class TextDocumentCompactor final
+	{
+	public:
+		TextDocumentCompactor(TextDocument* doc)
+			: Document(doc), NextElement(0)
+		{
+		}
+
+		TextDocumentCompactor(const TextDocumentCompactor&) = delete;
+		TextDocumentCompactor(TextDocumentCompactor&&) = delete;
+		TextDocumentCompactor& operator= (const TextDocumentCompactor&) = delete;
+
+	private:
+		TextDocument* const Document;
+		std::size_t NextElement; //Position to continue, as element index.
+
+		//Inactive segments waiting to be compressed together.
+		std::vector<TextSegment*> PendingSegments;
+		std::size_t PendingLength = 0;
+		std::vector<std::uint8_t> BlockData;
+
+	private:
+		void AddToBlock(TextSegment* s);
+		void FlushBlock();
+
+	public:
+		//Segments not modified since time (see TextDocument::GetTime) are made
+		//inactive. At least one leaf is processed regardless of the budget.
+		//Return true if a full pass over the document has finished.
+		bool Run(std::uint32_t time, std::size_t milliSeconds);
+
+		void Reset()
+		{
+			NextElement = 0;
+			PendingSegments.clear();
+			PendingLength = 0;
+		}
+	};
+}
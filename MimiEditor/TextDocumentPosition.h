@@ -22,6 +22,18 @@ namespace Mimi
 		std::size_t Position;
 	};
 
+	//Offset in code points.
+	struct DocumentPositionC
+	{
+		std::size_t Position;
+	};
+
+	//Offset in UTF-16 code units.
+	struct DocumentPositionU
+	{
+		std::size_t Position;
+	};
+
 	struct DocumentLabelIndex
 	{
 		TextSegment* Segment;
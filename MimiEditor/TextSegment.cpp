@@ -2,6 +2,10 @@
 #include "TextSegmentList.h"
 #include "TextDocument.h"
 #include "CodePage.h"
+#include "BlockCompression.h"
+#include <utility>
+
+static_assert(Mimi::TextSegmentTreeFactor <= 0xFF, "TextSegment: Index is 8-bit.");
 
 Mimi::TextSegment::TextSegment(Mimi::DynamicBuffer& buffer, bool continuous,
 	bool unfinished, ModifiedFlag modified)
@@ -9,7 +13,12 @@ Mimi::TextSegment::TextSegment(Mimi::DynamicBuffer& buffer, bool continuous,
 {
 	Parent = nullptr;
 	Index = 0;
-	ContentBuffer = buffer.MakeStaticBuffer();
+	Compressed = false;
+	Interned = false;
+	CompressedOffset = CompressedLength = 0;
+	CharacterCountValid = false;
+	CodePointCount = UTF16Count = 0;
+	SetInactiveContent(buffer);
 	ActiveData = nullptr;
 }
 
@@ -18,27 +27,121 @@ Mimi::TextSegment::TextSegment(bool continuous, bool unfinished, ModifiedFlag mo
 {
 	Parent = nullptr;
 	Index = 0;
+	Compressed = false;
+	Interned = false;
+	Inline = false;
+	InlineLength = 0;
+	CompressedOffset = CompressedLength = 0;
+	CharacterCountValid = false;
+	CodePointCount = UTF16Count = 0;
 	ContentBuffer.Clear();
 	ActiveData = nullptr;
 }
 
 Mimi::TextSegment::~TextSegment()
 {
-	if (ActiveData)
+	//ActiveData is allocated from the document and must be released by it.
+	assert(ActiveData == nullptr);
+	if (!Inline)
 	{
-		delete ActiveData;
+		ContentBuffer.TryClearRef();
 	}
-	ContentBuffer.TryClearRef();
 	Labels.Clear();
 }
 
+void Mimi::TextSegment::UpdateMemoryUsage(bool add)
+{
+	if (Parent == nullptr) return; //Not counted yet.
+	TextDocument* doc = GetDocument();
+	std::size_t inactive = 0, active = 0, tracer = 0;
+	std::size_t compressed = 0, compressedLength = 0, compressedBytes = 0;
+	std::size_t interned = 0, internedLength = 0;
+	std::size_t inlined = 0, inlineLength = 0;
+	if (IsActive())
+	{
+		active = ActiveData->ContentBuffer.GetMemorySize();
+		tracer = ActiveData->Modifications.GetMemorySize();
+	}
+	else if (Inline)
+	{
+		//No memory outside of the segment.
+		inlined = 1;
+		inlineLength = InlineLength;
+	}
+	else if (Compressed)
+	{
+		//Share of the block, proportional to the decoded length.
+		compressed = 1;
+		compressedLength = CompressedLength;
+		compressedBytes = CompressedLength * ContentBuffer.GetSize() /
+			BlockCompression::GetDecodedSize(ContentBuffer);
+	}
+	else if (Interned)
+	{
+		//Content is counted once in the intern table.
+		interned = 1;
+		internedLength = ContentBuffer.GetSize();
+	}
+	else if (!ContentBuffer.IsNull())
+	{
+		inactive = ContentBuffer.GetSize();
+	}
+	if (add)
+	{
+		doc->InactiveContentBytes += inactive;
+		doc->ActiveContentCapacity += active;
+		doc->TracerBytes += tracer;
+		doc->CompressedSegmentCount += compressed;
+		doc->CompressedContentLength += compressedLength;
+		doc->CompressedContentBytes += compressedBytes;
+		doc->InternedSegmentCount += interned;
+		doc->InternedContentLength += internedLength;
+		doc->InlineSegmentCount += inlined;
+		doc->InlineContentLength += inlineLength;
+	}
+	else
+	{
+		doc->InactiveContentBytes -= inactive;
+		doc->ActiveContentCapacity -= active;
+		doc->TracerBytes -= tracer;
+		doc->CompressedSegmentCount -= compressed;
+		doc->CompressedContentLength -= compressedLength;
+		doc->CompressedContentBytes -= compressedBytes;
+		doc->InternedSegmentCount -= interned;
+		doc->InternedContentLength -= internedLength;
+		doc->InlineSegmentCount -= inlined;
+		doc->InlineContentLength -= inlineLength;
+	}
+}
+
+void Mimi::TextSegment::UpdateLabelMemoryUsage(std::size_t oldHeapSize)
+{
+	if (Parent == nullptr) return;
+	TextDocument* doc = GetDocument();
+	doc->LabelBytes -= oldHeapSize;
+	doc->LabelBytes += Labels.GetHeapSize();
+}
+
+void Mimi::TextSegment::OnAddedToTree()
+{
+	UpdateMemoryUsage(true);
+	UpdateLabelMemoryUsage(0);
+}
+
+void Mimi::TextSegment::OnRemovedFromTree()
+{
+	UpdateMemoryUsage(false);
+	GetDocument()->LabelBytes -= Labels.GetHeapSize();
+}
+
 void Mimi::TextSegment::AddToList(TextSegmentList* list, std::size_t index)
 {
 	assert(index < TextSegmentTreeFactor);
 	assert(Parent == nullptr);
 	assert(list != nullptr);
+	assert(index < 256); //Index is 8-bit.
 	Parent = list;
-	Index = static_cast<std::uint16_t>(index);
+	Index = static_cast<std::uint8_t>(index);
 }
 
 Mimi::TextSegment* Mimi::TextSegment::GetPreviousSegment()
@@ -58,6 +161,10 @@ int Mimi::TextSegment::ComparePosition(TextSegment * s1, TextSegment * s2)
 	if (s1 == s2) return 0;
 	TextSegmentList* l1 = s1->GetParent();
 	TextSegmentList* l2 = s2->GetParent();
+	if (l1 == l2)
+	{
+		return s1->Index > s2->Index ? 1 : -1;
+	}
 	return TextSegmentList::ComparePosition(l1, l2);
 }
 
@@ -68,40 +175,160 @@ Mimi::TextDocument* Mimi::TextSegment::GetDocument()
 
 std::size_t Mimi::TextSegment::GetLineIndex()
 {
-	std::size_t n = Parent->GetAbsLineIndex();
-	for (std::uint16_t i = 0; i < Index; ++i)
-	{
-		if (!Parent->DataAsElement()[i]->IsContinuous())
-		{
-			n += 1;
-		}
-	}
-	return n;
+	return GetDocument()->SegmentTree.ConvertPositionToL({ this, 0 }).Line;
 }
 
 void Mimi::TextSegment::MakeActive()
 {
 	if (IsActive()) return;
+	ReleaseSnapshotCache();
+	Decompress();
+	UpdateMemoryUsage(false);
 
-	std::size_t length = ContentBuffer.GetSize();
-	ActiveData = new ActiveTextSegmentData(ContentBuffer.MoveRef());
+	std::size_t length;
+	if (Inline)
+	{
+		length = InlineLength;
+		ActiveData = GetDocument()->NewActiveData(this);
+		ActiveData->ContentBuffer.Append(InlineData, length);
+		Inline = false;
+		ContentBuffer.Clear();
+	}
+	else
+	{
+		length = ContentBuffer.GetSize();
+		ActiveData = GetDocument()->NewActiveData(this, ContentBuffer.MoveRef());
+	}
+	Interned = false;
 
 	//Setup modification tracer
 	ActiveData->Modifications.Resize(GetDocument()->GetSnapshotCapacity());
+	ActiveData->CapacityEpoch = GetDocument()->SnapshotCapacityEpoch;
 	std::size_t count = GetDocument()->GetSnapshotCount();
 	for (std::size_t i = 0; i < count; ++i)
 	{
 		ActiveData->Modifications.NewSnapshot(i + 1, length);
 	}
+	ActiveData->SnapshotIndex = GetDocument()->NextSnapshotIndex;
+	UpdateMemoryUsage(true);
+}
+
+void Mimi::TextSegment::Compress(StaticBuffer block, std::size_t offset)
+{
+	assert(!IsActive() && !Compressed && !Inline);
+	ReleaseSnapshotCache();
+	UpdateMemoryUsage(false);
+	CompressedLength = ContentBuffer.GetSize();
+	CompressedOffset = static_cast<std::uint16_t>(offset);
+	ContentBuffer.ClearRef();
+	ContentBuffer = block.NewRef();
+	Compressed = true;
+	UpdateMemoryUsage(true);
+}
+
+void Mimi::TextSegment::Decompress()
+{
+	if (!Compressed) return;
+	ReleaseSnapshotCache();
+	UpdateMemoryUsage(false);
+	//The cache keeps a reference to the block, so data is still valid after
+	//ContentBuffer is released.
+	const std::uint8_t* data = GetDocument()->BlockCache.Get(ContentBuffer);
+	ContentBuffer.ClearRef();
+	if (CompressedLength <= InlineCapacity)
+	{
+		std::memcpy(InlineData, &data[CompressedOffset], CompressedLength);
+		InlineLength = static_cast<std::uint8_t>(CompressedLength);
+		Inline = true;
+	}
+	else
+	{
+		ContentBuffer = StaticBuffer::Create(&data[CompressedOffset], CompressedLength);
+	}
+	Compressed = false;
+	CompressedOffset = CompressedLength = 0;
+	UpdateMemoryUsage(true);
 }
 
 void Mimi::TextSegment::MakeInactive()
 {
 	if (!IsActive()) return;
 	assert(GetDocument()->GetSnapshotCount() == 0);
-	ContentBuffer = ActiveData->ContentBuffer.MakeStaticBuffer();
-	delete ActiveData;
+	ReleaseSnapshotCache();
+	UpdateMemoryUsage(false);
+	SetInactiveContent(ActiveData->ContentBuffer);
+	GetDocument()->DeleteActiveData(ActiveData);
 	ActiveData = nullptr;
+	if (GetDocument()->DeduplicationEnabled)
+	{
+		Intern(GetDocument()->InternTable);
+	}
+	UpdateMemoryUsage(true);
+}
+
+void Mimi::TextSegment::Intern(BufferInternTable& table)
+{
+	assert(!IsActive());
+	if (Interned || Compressed || Inline)
+	{
+		return;
+	}
+	std::size_t size = ContentBuffer.GetSize();
+	if (size == 0 || size > BufferInternTable::MaxInternLength)
+	{
+		return;
+	}
+	ReleaseSnapshotCache();
+	ContentBuffer = table.Intern(ContentBuffer.MoveRef());
+	Interned = true;
+}
+
+void Mimi::TextSegment::SetInactiveContent(DynamicBuffer& buffer)
+{
+	std::size_t length = buffer.GetLength();
+	if (length <= InlineCapacity)
+	{
+		buffer.CopyTo(InlineData, 0, length);
+		InlineLength = static_cast<std::uint8_t>(length);
+		Inline = true;
+	}
+	else
+	{
+		ContentBuffer = buffer.MakeStaticBuffer();
+		Inline = false;
+	}
+}
+
+void Mimi::TextSegment::ReleaseSnapshotCache()
+{
+	if (Parent)
+	{
+		Parent->ReleaseSnapshotCache();
+	}
+}
+
+void Mimi::TextSegment::MoveToHeap()
+{
+	if (!Inline) return;
+	StaticBuffer buffer = StaticBuffer::Create(InlineData, InlineLength);
+	Inline = false;
+	ContentBuffer = buffer;
+}
+
+void Mimi::TextSegment::MoveToInline()
+{
+	if (IsActive() || Inline || Compressed || Interned || ContentBuffer.IsNull()) return;
+	std::size_t length = ContentBuffer.GetSize();
+	if (length > InlineCapacity) return;
+	ReleaseSnapshotCache();
+	//Only when no snapshot is using the buffer.
+	if (!ContentBuffer.IsUnique()) return;
+	std::uint8_t data[InlineCapacity];
+	std::memcpy(data, ContentBuffer.GetRawData(), length);
+	ContentBuffer.ClearRef();
+	std::memcpy(InlineData, data, length);
+	InlineLength = static_cast<std::uint8_t>(length);
+	Inline = true;
 }
 
 Mimi::TextSegment* Mimi::TextSegment::Split(std::size_t pos, bool newLine)
@@ -128,18 +355,33 @@ Mimi::TextSegment* Mimi::TextSegment::Split(std::size_t pos, bool newLine)
 	}
 
 	//Make the new segment
-	TextSegment* newSegment = new TextSegment(!newLine, Continuous.IsUnfinished(), ModifiedFlag::All);
+	TextDocument* doc = GetDocument();
+	TextSegment* newSegment = doc->NewSegment(!newLine, Continuous.IsUnfinished(), ModifiedFlag::All);
 	Continuous.SetUnfinished(!newLine);
-	newSegment->ActiveData = new ActiveTextSegmentData();
-
-	newSegment->ActiveData->LastModifiedTime = ActiveData->LastModifiedTime;
+	Modified.Modify();
+	UpdateTracer();
 
 	//Content
-	ActiveData->ContentBuffer.SplitRight(newSegment->ActiveData->ContentBuffer, pos);
+	UpdateMemoryUsage(false);
+	CharacterCountValid = false;
+	if (pos == 0)
+	{
+		//Move the whole buffer. This segment allocates when it's written again.
+		newSegment->ActiveData = doc->NewActiveData(newSegment, std::move(ActiveData->ContentBuffer));
+	}
+	else
+	{
+		newSegment->ActiveData = doc->NewActiveData(newSegment);
+		ActiveData->ContentBuffer.SplitRight(newSegment->ActiveData->ContentBuffer, pos);
+	}
+	newSegment->ActiveData->LastModifiedTime = ActiveData->LastModifiedTime;
 	//Modification
 	newSegment->ActiveData->Modifications.Resize(GetDocument()->GetSnapshotCapacity());
+	newSegment->ActiveData->SnapshotIndex = ActiveData->SnapshotIndex;
+	newSegment->ActiveData->CapacityEpoch = ActiveData->CapacityEpoch;
 	ActiveData->Modifications.SplitInto(newSegment->ActiveData->Modifications,
 		GetDocument()->GetSnapshotCount(), pos);
+	UpdateMemoryUsage(true);
 	//Label
 	LabelSplit(newSegment, pos);
 
@@ -156,6 +398,8 @@ void Mimi::TextSegment::Merge()
 
 	MakeActive();
 	other->MakeActive();
+	UpdateTracer();
+	other->UpdateTracer();
 
 	Modified.Modify();
 	other->Modified.Modify();
@@ -172,22 +416,34 @@ void Mimi::TextSegment::Merge()
 	}
 
 	//Content
-	ActiveData->ContentBuffer.Insert(ActiveData->ContentBuffer.GetLength(),
-		other->ActiveData->ContentBuffer.GetRawData(),
-		other->ActiveData->ContentBuffer.GetLength());
+	UpdateMemoryUsage(false);
+	other->UpdateMemoryUsage(false);
+	CharacterCountValid = false;
+	if (GetCurrentLength() == 0)
+	{
+		//Take the buffer of other.
+		ActiveData->ContentBuffer = std::move(other->ActiveData->ContentBuffer);
+	}
+	else if (other->GetCurrentLength() != 0)
+	{
+		ActiveData->ContentBuffer.Insert(ActiveData->ContentBuffer.GetLength(),
+			other->ActiveData->ContentBuffer.GetRawData(),
+			other->ActiveData->ContentBuffer.GetLength());
+	}
 	//Modification
 	other->ActiveData->Modifications.Resize(GetDocument()->GetSnapshotCapacity());
 	ActiveData->Modifications.MergeWith(other->ActiveData->Modifications,
 		GetDocument()->GetSnapshotCount());
+	UpdateMemoryUsage(true);
+	other->UpdateMemoryUsage(true); //Removed from the tree below.
 	//Label
 	LabelMerge(other);
 
 	//Dispose
-	other->ActiveData->SnapshotCache.ClearRef();
-	other->ContentBuffer.ClearRef();
+	TextDocument* doc = GetDocument();
 	other->Labels.Clear();
 	other->Parent->RemoveElement(other->Index);
-	delete other;
+	doc->DeleteSegment(other);
 }
 
 void Mimi::TextSegment::ReplaceText(std::size_t pos, std::size_t sel, DynamicBuffer* content, std::size_t globalPosition)
@@ -200,19 +456,24 @@ void Mimi::TextSegment::ReplaceText(std::size_t pos, std::size_t sel, DynamicBuf
 		content->GetLength() < MaxLength - (ActiveData->ContentBuffer.GetLength() - sel));
 
 	std::size_t insertLen = content ? content->GetLength() : 0;
+	Modified.Modify();
+	UpdateTracer();
 
-	//Content
-	ActiveData->ContentBuffer.Replace(pos, sel, content ? content->GetRawData() : nullptr, insertLen);
+	//Content (in gap mode, as active segments are usually edited continuously)
+	UpdateMemoryUsage(false);
+	ActiveData->ContentBuffer.GapReplace(pos, sel, content ? content->GetRawData() : nullptr, insertLen);
+	CharacterCountValid = false;
 	//Modification tracer
 	if (GetDocument()->GetSnapshotCount()) //TODO create a snapshot at the beginning?
 	{
 		ActiveData->Modifications.Delete(pos, sel);
 		ActiveData->Modifications.Insert(pos, insertLen);
 	}
+	UpdateMemoryUsage(true);
 	//Labels
 	UpdateLabels(pos, sel, insertLen, globalPosition);
 	//Event
-	GetParent()->OnElementDataChanged(); //TODO Called at document level API?
+	GetParent()->OnElementDataChanged(Index); //TODO Called at document level API?
 }
 
 void Mimi::TextSegment::CheckAndMakeInactive(std::uint32_t time)
@@ -224,6 +485,55 @@ void Mimi::TextSegment::CheckAndMakeInactive(std::uint32_t time)
 	}
 }
 
+void Mimi::TextSegment::Compact(std::uint32_t time)
+{
+	CheckAndMakeInactive(time);
+	if (IsActive())
+	{
+		UpdateMemoryUsage(false);
+		ActiveData->ContentBuffer.Shink();
+		UpdateMemoryUsage(true);
+	}
+	else
+	{
+		//Content moved to the heap by a snapshot, or inactive before
+		//deduplication was enabled.
+		UpdateMemoryUsage(false);
+		MoveToInline();
+		if (GetDocument()->DeduplicationEnabled)
+		{
+			Intern(GetDocument()->InternTable);
+		}
+		UpdateMemoryUsage(true);
+	}
+
+	//Labels can't be moved (their indexes are held by the user), so only the
+	//empty slots at the end are removed.
+	LabelData* first = Labels.GetPointer();
+	std::size_t count = Labels.GetCount();
+	std::size_t end = 0;
+	for (std::size_t i = 0; i < count; )
+	{
+		std::size_t len = GetLabelLength(&first[i]);
+		if (len == 0)
+		{
+			i += 1;
+		}
+		else
+		{
+			i += len;
+			end = i;
+		}
+	}
+	if (end < count)
+	{
+		Labels.RemoveRange(end, count - end);
+	}
+	std::size_t oldHeapSize = Labels.GetHeapSize();
+	Labels.Shink();
+	UpdateLabelMemoryUsage(oldHeapSize);
+}
+
 void Mimi::TextSegment::EnsureInsertionSize(std::size_t pos, std::size_t size,
 	DocumentPositionS* before, DocumentPositionS* after)
 {
@@ -284,16 +594,126 @@ bool Mimi::TextSegment::HasLineBreak()
 	{
 		return false;
 	}
-	const Mimi::mchar8_t* bufferEnd;
+	const Mimi::mchar8_t* bufferEnd = &GetContentData()[GetCurrentLength()];
+	return GetLastChar(bufferEnd, GetDocument()->TextEncoding) == '\n';
+}
+
+const std::uint8_t* Mimi::TextSegment::GetContentData()
+{
 	if (IsActive())
 	{
-		bufferEnd = &ActiveData->ContentBuffer.GetRawData()[ActiveData->ContentBuffer.GetLength()];
+		return ActiveData->ContentBuffer.GetRawData();
+	}
+	else if (Compressed)
+	{
+		const std::uint8_t* data = GetDocument()->BlockCache.Get(ContentBuffer);
+		return &data[CompressedOffset];
+	}
+	else if (Inline)
+	{
+		return InlineData;
 	}
 	else
 	{
-		bufferEnd = &ContentBuffer.GetRawData()[ContentBuffer.GetSize()];
+		return ContentBuffer.GetRawData();
 	}
-	return GetLastChar(bufferEnd, GetDocument()->TextEncoding) == '\n';
+}
+
+//Scan the characters in data[0, end), stopping before the character with which
+//the number of code points (or UTF-16 code units) would exceed limit.
+//Return the position where it stops.
+static std::size_t ScanCharacters(Mimi::CodePage cp, const Mimi::mchar8_t* data, std::size_t end,
+	std::size_t limit, bool utf16, std::size_t* codePoints, std::size_t* utf16Units)
+{
+	std::size_t pos = 0, c = 0, u = 0;
+	if (cp == Mimi::CodePageManager::UTF8)
+	{
+		//Fast path. Each byte except 10xxxxxx starts a character, and 4-byte
+		//characters are surrogate pairs.
+		while (pos < end)
+		{
+			std::uint8_t b = data[pos];
+			if ((b & 0xC0) != 0x80)
+			{
+				std::size_t w = b >= 0xF0 ? 2 : 1;
+				if ((utf16 ? u + w : c + 1) > limit) break;
+				c += 1;
+				u += w;
+			}
+			pos += 1;
+		}
+	}
+	else
+	{
+		std::size_t width = cp.GetNormalWidth();
+		while (pos < end)
+		{
+			//Converter may read 4 bytes.
+			Mimi::mchar8_t src[4] = {};
+			std::memcpy(src, &data[pos], end - pos < 4 ? end - pos : 4);
+			char16_t dest[2];
+			Mimi::BufferIncrement inc = cp.CharToUTF16(src, dest);
+			std::size_t r = inc.Source, w = inc.Destination;
+			if (r == 0 || r > end - pos)
+			{
+				r = width < end - pos ? width : end - pos;
+				w = 1;
+			}
+			if ((utf16 ? u + w : c + 1) > limit) break;
+			c += 1;
+			u += w;
+			pos += r;
+		}
+	}
+	if (codePoints) *codePoints = c;
+	if (utf16Units) *utf16Units = u;
+	return pos;
+}
+
+void Mimi::TextSegment::UpdateCharacterCount()
+{
+	if (CharacterCountValid) return;
+	const std::size_t max = std::numeric_limits<std::size_t>::max();
+	CodePage cp = GetDocument()->TextEncoding;
+	std::size_t c, u;
+	if (IsActive())
+	{
+		//Called after each edit. Keep the gap (which is at the last edit
+		//position, so characters are not split by it).
+		const std::uint8_t *front, *back;
+		std::size_t frontLength, backLength, c2, u2;
+		ActiveData->ContentBuffer.GetParts(&front, &frontLength, &back, &backLength);
+		ScanCharacters(cp, front, frontLength, max, false, &c, &u);
+		ScanCharacters(cp, back, backLength, max, false, &c2, &u2);
+		c += c2;
+		u += u2;
+	}
+	else
+	{
+		ScanCharacters(cp, GetContentData(), GetCurrentLength(), max, false, &c, &u);
+	}
+	CodePointCount = static_cast<std::uint16_t>(c);
+	UTF16Count = static_cast<std::uint16_t>(u);
+	CharacterCountValid = true;
+}
+
+std::size_t Mimi::TextSegment::CountCharacters(std::size_t pos, bool utf16)
+{
+	assert(pos <= GetCurrentLength());
+	std::size_t c, u;
+	ScanCharacters(GetDocument()->TextEncoding, GetContentData(), pos,
+		std::numeric_limits<std::size_t>::max(), false, &c, &u);
+	return utf16 ? u : c;
+}
+
+std::size_t Mimi::TextSegment::FindCharacter(std::size_t count, bool utf16)
+{
+	if (count >= GetCharacterCount(utf16))
+	{
+		return GetCurrentLength();
+	}
+	return ScanCharacters(GetDocument()->TextEncoding, GetContentData(), GetCurrentLength(),
+		count, utf16, nullptr, nullptr);
 }
 
 void Mimi::TextSegment::CheckLineBreak()
@@ -317,66 +737,109 @@ void Mimi::TextSegment::CheckLineBreak()
 	}
 }
 
-Mimi::StaticBuffer Mimi::TextSegment::MakeSnapshot(bool resize)
+void Mimi::TextSegment::UpdateTracer()
 {
-	//Start tracing
-	std::size_t cap = GetDocument()->GetSnapshotCapacity();
-	std::size_t count = GetDocument()->GetSnapshotCount();
-	assert(cap >= count);
-	if (IsActive())
+	assert(IsActive());
+	TextDocument* doc = GetDocument();
+	bool resize = ActiveData->CapacityEpoch != doc->SnapshotCapacityEpoch;
+	std::size_t created = doc->NextSnapshotIndex - ActiveData->SnapshotIndex;
+	if (!resize && created == 0) return;
+	UpdateMemoryUsage(false);
+	if (resize)
 	{
-		if (resize)
-		{
-			ActiveData->Modifications.Resize(cap);
-		}
-		ActiveData->Modifications.NewSnapshot(count, ActiveData->ContentBuffer.GetLength());
+		//The capacity is at least the number of snapshots, so slots removed
+		//when shrinking are not used.
+		ActiveData->Modifications.Resize(doc->GetSnapshotCapacity());
+		ActiveData->CapacityEpoch = doc->SnapshotCapacityEpoch;
+	}
+	//Content has not changed since the last update, so the new snapshots (the
+	//first ones in the tracer) all start from the current content. Older ones
+	//are not changed.
+	std::size_t count = doc->GetSnapshotCount();
+	std::size_t start = created < count ? count - created : 0;
+	for (std::size_t i = start; i < count; ++i)
+	{
+		ActiveData->Modifications.NewSnapshot(i + 1, ActiveData->ContentBuffer.GetLength());
 	}
+	UpdateMemoryUsage(true);
+	ActiveData->SnapshotIndex = doc->NextSnapshotIndex;
+}
 
-	//Make a buffer
+Mimi::StaticBufferRange Mimi::TextSegment::MakeSnapshotBuffer()
+{
+	StaticBufferRange ret;
+	ret.Compressed = false;
+	ret.Continuous = IsContinuous();
+	ret.Offset = 0;
 	if (!IsActive())
 	{
-		return ContentBuffer.NewRef();
+		if (Inline)
+		{
+			//Snapshot needs a shared buffer.
+			UpdateMemoryUsage(false);
+			MoveToHeap();
+			UpdateMemoryUsage(true);
+		}
+		//Compressed block is decoded by the reader.
+		ret.Buffer = ContentBuffer.NewRef();
+		ret.Compressed = Compressed;
+		ret.Offset = CompressedOffset;
 	}
 	else if (!Modified.SinceSnapshot() && !ActiveData->SnapshotCache.IsNull())
 	{
-		return ActiveData->SnapshotCache.NewRef();
+		ret.Buffer = ActiveData->SnapshotCache.NewRef();
 	}
 	else
 	{
-		StaticBuffer ret = ActiveData->ContentBuffer.MakeStaticBuffer();
+		StaticBuffer buffer = ActiveData->ContentBuffer.MakeStaticBuffer();
 		ActiveData->SnapshotCache.TryClearRef();
-		ActiveData->SnapshotCache = ret;
+		ActiveData->SnapshotCache = buffer;
 		Modified.ClearSnapshot();
-		return ret.NewRef();
+		ret.Buffer = buffer.NewRef();
 	}
+	ret.Length = static_cast<std::uint16_t>(GetCurrentLength());
+	return ret;
 }
 
-void Mimi::TextSegment::DisposeSnapshot(std::size_t num, bool resize)
+std::size_t Mimi::TextSegment::ConvertSnapshotPosition(std::size_t snapshot, std::size_t pos, int dir)
 {
 	if (IsActive())
 	{
-		std::size_t newNum = GetDocument()->GetSnapshotCount();
-		ActiveData->Modifications.DisposeSnapshot(newNum + num, newNum);
-		if (resize)
-		{
-			ActiveData->Modifications.Resize(GetDocument()->GetSnapshotCapacity());
-		}
+		UpdateTracer();
+		return ActiveData->Modifications.ConvertFromSnapshot(snapshot, pos, dir);
 	}
+	return pos;
 }
 
-std::size_t Mimi::TextSegment::ConvertSnapshotPosition(std::size_t snapshot, std::size_t pos, int dir)
+void Mimi::TextSegment::ConvertSnapshotPositions(std::size_t snapshot, std::size_t* pos,
+	const int* dir, std::size_t count)
 {
 	if (IsActive())
 	{
-		return ActiveData->Modifications.ConvertFromSnapshot(snapshot, pos, dir);
+		UpdateTracer();
+		ActiveData->Modifications.ConvertFromSnapshotSorted(snapshot, pos, dir, count);
+	}
+}
+
+void Mimi::TextSegment::GetSnapshotChanges(std::size_t oldSnapshot, std::size_t newSnapshot,
+	std::vector<SnapshotChange>& result)
+{
+	if (IsActive())
+	{
+		UpdateTracer();
+		ActiveData->Modifications.GetChanges(oldSnapshot, newSnapshot, result);
+	}
+	else
+	{
+		result.clear();
 	}
-	return pos;
 }
 
 std::size_t Mimi::TextSegment::GetHistoryLength(std::size_t snapshot)
 {
 	if (IsActive())
 	{
+		UpdateTracer();
 		return ActiveData->Modifications.GetSnapshotLength(snapshot);
 	}
 	return GetCurrentLength();
@@ -609,6 +1072,7 @@ void Mimi::TextSegment::MoveLabels(TextSegment* dest, std::size_t begin)
 	LabelData* firstRef = nullptr;
 	LabelData* lastRef = nullptr;
 	std::size_t lastLen = 0;
+	bool moveAll = true;
 	while (NextLabel(&i))
 	{
 		LabelData* label = ReadLabelData(i);
@@ -620,7 +1084,30 @@ void Mimi::TextSegment::MoveLabels(TextSegment* dest, std::size_t begin)
 				lastRef = label;
 				lastLen = GetLabelLength(label);
 			}
+			if (begin == 0 && (label->Type & LabelType::Continuous))
+			{
+				moveAll = false; //Need to merge with dest.
+			}
+		}
+		else
+		{
+			moveAll = false;
+		}
+	}
+	if (moveAll && dest->Labels.GetCount() == 0)
+	{
+		//Take the whole array. Indexes (also those linked from the next segment)
+		//are unchanged. Handlers read the label data, so notify before moving.
+		if (firstRef)
+		{
+			NotifyLabelOwnerChanged(dest, begin, GetCurrentLength(), 0);
 		}
+		std::size_t oldHeapSize = Labels.GetHeapSize();
+		std::size_t destOldHeapSize = dest->Labels.GetHeapSize();
+		dest->Labels = std::move(Labels);
+		UpdateLabelMemoryUsage(oldHeapSize);
+		dest->UpdateLabelMemoryUsage(destOldHeapSize);
+		return;
 	}
 	TextSegment* next = GetNextSegment();
 	//Move referred labels.
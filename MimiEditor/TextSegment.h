@@ -8,6 +8,7 @@
 #include <cstddef>
 #include <vector>
 #include <limits>
+#include <utility>
 
 namespace Mimi
 {
@@ -15,6 +16,7 @@ namespace Mimi
 	class TextSegment;
 	class TextSegmentList;
 	class LabelOwnerChangedEvent;
+	class BufferInternTable;
 	struct TextDocumentLabelAccess;
 
 	struct ModifiedFlag
@@ -84,14 +86,34 @@ namespace Mimi
 			: ContentBuffer(content)
 		{
 			LastModifiedTime = 0;
+			SnapshotIndex = 0;
+			CapacityEpoch = 0;
 			SnapshotCache = content.MoveRef();
+			Segment = nullptr;
+			PreviousActive = NextActive = nullptr;
 		}
 
 		ActiveTextSegmentData()
 			: ContentBuffer(0)
 		{
 			LastModifiedTime = 0;
+			SnapshotIndex = 0;
+			CapacityEpoch = 0;
 			SnapshotCache.Clear();
+			Segment = nullptr;
+			PreviousActive = NextActive = nullptr;
+		}
+
+		//Take over the content of another segment.
+		ActiveTextSegmentData(DynamicBuffer&& content)
+			: ContentBuffer(std::move(content))
+		{
+			LastModifiedTime = 0;
+			SnapshotIndex = 0;
+			CapacityEpoch = 0;
+			SnapshotCache.Clear();
+			Segment = nullptr;
+			PreviousActive = NextActive = nullptr;
 		}
 
 		~ActiveTextSegmentData()
@@ -101,6 +123,17 @@ namespace Mimi
 
 	public:
 		std::uint32_t LastModifiedTime;
+		//Index of the next snapshot of the document when Modifications was last
+		//updated. Snapshots created after it are added lazily (UpdateTracer).
+		std::size_t SnapshotIndex;
+		//TextDocument::SnapshotCapacityEpoch when Modifications was last resized.
+		std::size_t CapacityEpoch;
+
+		//Intrusive list of active segments in the document (see
+		//TextDocument::FirstActive). Inactive segments carry no links.
+		TextSegment* Segment;
+		ActiveTextSegmentData* PreviousActive;
+		ActiveTextSegmentData* NextActive;
 
 		DynamicBuffer ContentBuffer;
 		StaticBuffer SnapshotCache;
@@ -110,12 +143,16 @@ namespace Mimi
 	class TextSegment final
 	{
 		friend class TextSegmentList; //Index, Parent
+		friend class TextSegmentTree; //ActiveData (destruction)
 		friend struct TextDocumentLabelAccess; //ReadLabelData
 		friend class TextDocumentLabelIterator; //Multiple Label functions
 		friend class LabelOwnerChangedEvent; //ReadLabelData
 		friend class TextDocument; //Label manipulation
+		friend class TextDocumentCompactor; //Compression
 
 		static const std::size_t MaxLength = 0xFFFF;
+		//Inactive content up to this length is stored in the segment itself.
+		static const std::size_t InlineCapacity = 16;
 
 	public:
 		TextSegment(DynamicBuffer& buffer, bool continuous, bool unfinished, ModifiedFlag modified);
@@ -129,13 +166,33 @@ namespace Mimi
 
 	private:
 		TextSegmentList* Parent;
-		std::uint16_t Index;
+		std::uint8_t Index;
 
 		ContinuousFlag Continuous;
 		ModifiedFlag Modified;
 
-		StaticBuffer ContentBuffer;
-		ShortVector<LabelData> Labels;
+		//Content of inactive segment. If Compressed, ContentBuffer is a compressed
+		//block (see BlockCompression) shared with other segments, and the content
+		//is in the decoded data at the given offset.
+		bool Compressed;
+		//ContentBuffer is shared through the intern table of the document.
+		bool Interned;
+		//Content is in InlineData instead of ContentBuffer.
+		bool Inline;
+		std::uint8_t InlineLength;
+		//Cached number of code points and UTF-16 code units in the content.
+		bool CharacterCountValid;
+		std::uint16_t CompressedOffset;
+		std::uint16_t CompressedLength;
+		std::uint16_t CodePointCount;
+		std::uint16_t UTF16Count;
+		union
+		{
+			StaticBuffer ContentBuffer;
+			std::uint8_t InlineData[InlineCapacity];
+		};
+		//Slot 0 and 1 (reserved for cursors) are stored inline.
+		ShortVector<LabelData, 2> Labels;
 
 		ActiveTextSegmentData* ActiveData;
 		//render height?
@@ -143,6 +200,16 @@ namespace Mimi
 	private:
 		void AddToList(TextSegmentList* list, std::size_t index);
 
+		//Memory accounting (see DocumentMemoryUsage). A segment is counted by the
+		//document while it's in the tree. Any change to the content or the
+		//ModificationTracer of a segment in the tree must be enclosed by
+		//UpdateMemoryUsage(false) and UpdateMemoryUsage(true). Label arrays are
+		//updated with UpdateLabelMemoryUsage whenever the capacity changes.
+		void UpdateMemoryUsage(bool add);
+		void UpdateLabelMemoryUsage(std::size_t oldHeapSize);
+		void OnAddedToTree();
+		void OnRemovedFromTree();
+
 	public:
 		TextSegmentList* GetParent()
 		{
@@ -178,18 +245,65 @@ namespace Mimi
 			return ActiveData != nullptr;
 		}
 
+		//Counted on first use after the content changes. Assume no character is
+		//split by segment boundaries. Invalid bytes are counted as characters.
+		std::size_t GetCodePointCount()
+		{
+			UpdateCharacterCount();
+			return CodePointCount;
+		}
+
+		std::size_t GetUTF16Count()
+		{
+			UpdateCharacterCount();
+			return UTF16Count;
+		}
+
+		std::size_t GetCharacterCount(bool utf16)
+		{
+			return utf16 ? GetUTF16Count() : GetCodePointCount();
+		}
+
+		//Number of code points (or UTF-16 code units) before pos.
+		std::size_t CountCharacters(std::size_t pos, bool utf16);
+		//Position after count code points (or UTF-16 code units). A position in a
+		//surrogate pair is moved to the beginning of the character.
+		std::size_t FindCharacter(std::size_t count, bool utf16);
+
 		std::size_t GetCurrentLength()
 		{
 			if (IsActive())
 			{
 				return ActiveData->ContentBuffer.GetLength();
 			}
+			if (Compressed)
+			{
+				return CompressedLength;
+			}
+			if (Inline)
+			{
+				return InlineLength;
+			}
 			return ContentBuffer.GetSize();
 		}
 
 	private:
 		void MakeActive();
 		void MakeInactive();
+		void Compress(StaticBuffer block, std::size_t offset);
+		void Decompress();
+		void Intern(BufferInternTable& table);
+		void SetInactiveContent(DynamicBuffer& buffer);
+		void MoveToHeap();
+		void MoveToInline();
+		//Snapshot nodes cached by the tree keep the old content alive. Release
+		//them before changing how the content is stored.
+		void ReleaseSnapshotCache();
+		//Start tracing for snapshots created since the last update. Must be
+		//called before the tracer is used.
+		void UpdateTracer();
+		const std::uint8_t* GetContentData();
+		void UpdateCharacterCount();
 		TextSegment* Split(std::size_t pos, bool newLine);
 		void Merge();
 
@@ -207,6 +321,9 @@ namespace Mimi
 
 		void CheckAndMakeInactive(std::uint32_t time);
 
+		//Release unused memory (see TextDocumentCompactor).
+		void Compact(std::uint32_t time);
+
 		DocumentPositionS InsertLineBreak(std::size_t pos)
 		{
 			return { Split(pos, true), 0 };
@@ -219,10 +336,16 @@ namespace Mimi
 		void CheckLineBreak();
 
 	public:
-		StaticBuffer MakeSnapshot(bool resize);
-		void DisposeSnapshot(std::size_t num, bool resize);
+		//Content for a snapshot.
+		StaticBufferRange MakeSnapshotBuffer();
 		std::size_t ConvertSnapshotPosition(std::size_t snapshot, std::size_t pos, int dir);
+		//Positions sorted in ascending order, converted in place.
+		void ConvertSnapshotPositions(std::size_t snapshot, std::size_t* pos, const int* dir,
+			std::size_t count);
 		std::size_t GetHistoryLength(std::size_t snapshot);
+		//Changes in this segment from snapshot oldSnapshot to a newer one.
+		void GetSnapshotChanges(std::size_t oldSnapshot, std::size_t newSnapshot,
+			std::vector<SnapshotChange>& result);
 
 	private:
 		static std::size_t GetLabelLength(LabelData* label)
@@ -258,6 +381,7 @@ namespace Mimi
 				else
 				{
 					count = 0;
+					i += len - 1; //Skip additional slots, which don't have a Type.
 				}
 			}
 			//Remove empty from tail.
@@ -265,7 +389,11 @@ namespace Mimi
 			{
 				Labels.RemoveRange(Labels.GetCount() - count, count);
 			}
-			return Labels.Emplace(size) - Labels.GetPointer(); //Possible reallocation
+			std::size_t oldHeapSize = Labels.GetHeapSize();
+			LabelData* label = Labels.Emplace(size); //Possible reallocation
+			std::size_t ret = label - Labels.GetPointer();
+			UpdateLabelMemoryUsage(oldHeapSize);
+			return ret;
 		}
 
 		void EraseLabelSpace(std::size_t index, std::size_t size)
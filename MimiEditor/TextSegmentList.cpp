@@ -1,86 +1,268 @@
 #include "TextSegmentList.h"
 #include "TextSegment.h"
+#include "TextDocument.h"
+#include "SnapshotNode.h"
 
-Mimi::TextSegmentTree::TextSegmentTree(TextDocument* document, TextSegment* element)
+Mimi::TextSegmentTree::TextSegmentTree(TextDocument* document)
+	: Document(document), Version(0), DeferCountDepth(0), FirstDirtyLeaf(nullptr)
 {
-	TextSegmentList* root = new TextSegmentList();
+	//The document is still being constructed, but its arenas are ready.
+	TextSegmentList* root = NewNode();
 	Root = root;
 
-	root->DocumentPtr = document;
 	root->Index = 0;
 	root->IsLeaf = true;
 	root->ParentNode = nullptr;
-	root->Tree = this;
-	root->InsertElement(0, element);
 }
 
 Mimi::TextSegmentTree::~TextSegmentTree()
 {
 	assert(Root);
-	delete Root;
+	DestroyAll(Root);
 	Root = nullptr;
 }
 
+Mimi::TextSegmentList* Mimi::TextSegmentTree::NewNode()
+{
+	TextSegmentList* ret = new (Document->NodeArena.Allocate()) TextSegmentList();
+	ret->DocumentPtr = Document;
+	ret->Tree = this;
+	return ret;
+}
+
+void Mimi::TextSegmentTree::DeleteNode(TextSegmentList* node)
+{
+	if (node->SnapshotCache)
+	{
+		TextSegmentList::ReleaseSnapshotNode(node);
+	}
+	node->~TextSegmentList();
+	Document->NodeArena.Free(node);
+}
+
+void Mimi::TextSegmentTree::DestroyAll(TextSegmentList* node)
+{
+	//Only destructors are called here. Memory of segments and nodes is released
+	//in bulk when the arenas of the document are destroyed.
+	for (std::size_t i = 0; i < node->ChildrenCount; ++i)
+	{
+		if (node->IsLeaf)
+		{
+			TextSegment* s = node->DataAsElement()[i];
+			if (s->ActiveData)
+			{
+				Document->ActiveDataArena.Destroy(s->ActiveData);
+				s->ActiveData = nullptr;
+			}
+			Document->SegmentArena.Destroy(s);
+		}
+		else
+		{
+			DestroyAll(node->DataAsNode()[i]);
+		}
+	}
+	if (node->SnapshotCache)
+	{
+		TextSegmentList::ReleaseSnapshotNode(node);
+	}
+	node->ChildrenCount = 0;
+	node->~TextSegmentList();
+}
+
+void Mimi::TextSegmentTree::InsertFirst(TextSegment* element)
+{
+	assert(Root->IsLeaf && Root->ChildrenCount == 0);
+	Root->InsertElement(0, element);
+}
+
 Mimi::TextSegment* Mimi::TextSegmentTree::GetSegmentWithLineIndex(std::size_t index)
 {
+	UpdateDirtyCount();
+	assert(index < Root->LineCount);
+	TextSegmentList* node = Root;
+	while (!node->IsLeaf)
+	{
+		node = node->DataAsNode()[node->FindChild(node->ChildLineCount, &index)];
+	}
+	//The first segment with line count 1 after skipping index line starts.
+	return node->DataAsElement()[node->FindChild(node->ChildLineCount, &index)];
+}
+
+Mimi::TextSegment* Mimi::TextSegmentTree::GetSegmentWithElementIndex(std::size_t index)
+{
+	UpdateDirtyCount();
+	assert(index < Root->ElementCount);
 	TextSegmentList* node = Root;
-	std::size_t count = 0;
 	while (!node->IsLeaf)
 	{
 		TextSegmentList** ptr = node->DataAsNode();
-		while (count + (*ptr)->LineCount <= index)
+		while (index >= (*ptr)->ElementCount)
 		{
-			count = count + (*ptr)->LineCount;
+			index -= (*ptr)->ElementCount;
 			ptr += 1;
 			assert(*ptr);
 		}
 		node = *ptr;
 	}
+	return node->DataAsElement()[index];
+}
+
+std::size_t Mimi::TextSegmentTree::GetElementIndex(TextSegment* s)
+{
+	UpdateDirtyCount();
+	std::size_t index = s->GetIndexInList();
+	for (TextSegmentList* node = s->GetParent(); node->ParentNode; node = node->ParentNode)
 	{
-		TextSegment** ptr = node->DataAsElement();
-		while (count < index)
+		TextSegmentList** siblings = node->ParentNode->DataAsNode();
+		for (std::size_t i = 0; i < node->Index; ++i)
 		{
-			if (!(*ptr)->IsContinuous())
-			{
-				count += 1;
-			}
-			ptr += 1;
-			assert(*ptr);
+			index += siblings[i]->ElementCount;
 		}
-		return *ptr;
 	}
+	return index;
 }
 
 Mimi::DocumentPositionL Mimi::TextSegmentTree::ConvertPositionToL(DocumentPositionS s)
 {
-	TextSegment* seg = s.Segment;
-	std::size_t count = s.Position;
-	std::size_t line = seg->GetLineIndex();
-	while (seg->IsContinuous())
+	UpdateDirtyCount();
+	//Count line starts up to the segment, and the data after the last one.
+	std::size_t lines = 0, offset = s.Position;
+	bool found = false;
+
+	TextSegmentList* node = s.Segment->GetParent();
+
+	{
+		std::size_t index = s.Segment->GetIndexInList();
+		for (std::size_t i = index + 1; i-- > 0;)
+		{
+			if (!found && i < index)
+			{
+				offset += node->ChildDataLength[i];
+			}
+			if (node->ChildLineCount[i])
+			{
+				lines += 1;
+				found = true;
+			}
+		}
+	}
+
+	while (node->ParentNode)
 	{
-		seg = seg->GetPreviousSegment();
-		count += seg->GetCurrentLength();
+		TextSegmentList* parent = node->ParentNode;
+		std::size_t index = node->Index;
+		for (std::size_t i = index; i-- > 0;)
+		{
+			if (found)
+			{
+				lines += TextSegmentList::SumChildren(parent->ChildLineCount, i + 1);
+				break;
+			}
+			lines += parent->ChildLineCount[i];
+			if (parent->ChildLineCount[i])
+			{
+				offset += parent->DataAsNode()[i]->TailLength;
+				found = true;
+			}
+			else
+			{
+				offset += parent->ChildDataLength[i];
+			}
+		}
+		node = parent;
 	}
-	return { line, count };
+
+	//The first segment always starts a line.
+	assert(found && lines > 0);
+	return { lines - 1, offset };
 }
 
 Mimi::DocumentPositionS Mimi::TextSegmentTree::ConvertPositionFromL(DocumentPositionL l)
 {
 	TextSegment* seg = GetSegmentWithLineIndex(l.Line);
-	std::size_t count = l.Position;
-	while (count > seg->GetCurrentLength())
+	if (l.Position <= seg->GetCurrentLength())
+	{
+		return { seg, l.Position };
+	}
+
+	//Position in a following continuous segment.
+	DocumentPositionD d = ConvertPositionToD({ seg, 0 });
+	d.Position += l.Position;
+	DocumentPositionS ret = ConvertPositionFromD(d);
+	if (ret.Position == 0)
 	{
-		assert(seg->IsContinuous());
-		count -= seg->GetCurrentLength();
-		seg = seg->GetNextSegment();
+		//Use the end of the previous segment, which is in the same line.
+		ret.Segment = ret.Segment->GetPreviousSegment();
+		ret.Position = ret.Segment->GetCurrentLength();
 	}
-	return { seg, count };
+	assert(ret.Segment->IsContinuous());
+	return ret;
 }
 
 Mimi::DocumentPositionD Mimi::TextSegmentTree::ConvertPositionToD(DocumentPositionS s)
 {
 	std::size_t count = s.Position;
 
+	TextSegmentList* node = s.Segment->GetParent();
+	//Only counts before the leaf are used (lengths in the leaf itself are kept
+	//by OnElementDataChanged). Changes after it can wait, so that editing from
+	//the end to the beginning (e.g. with multiple cursors) in a transaction does
+	//not update the counts for each edit.
+	if (FirstDirtyLeaf && TextSegmentList::ComparePosition(FirstDirtyLeaf, node) < 0)
+	{
+		PropagateDirtyCount();
+	}
+	count += TextSegmentList::SumChildren(node->ChildDataLength, s.Segment->GetIndexInList());
+
+	while (node->ParentNode)
+	{
+		count += TextSegmentList::SumChildren(node->ParentNode->ChildDataLength, node->Index);
+		node = node->ParentNode;
+	}
+
+	return { count };
+}
+
+Mimi::DocumentPositionS Mimi::TextSegmentTree::ConvertPositionFromD(DocumentPositionD d)
+{
+	UpdateDirtyCount();
+	assert(d.Position <= Root->DataLength);
+	//The end of the document is in the last segment.
+	TextSegmentList* node = Root;
+	std::size_t position = d.Position;
+	while (!node->IsLeaf)
+	{
+		node = node->DataAsNode()[node->FindChild(node->ChildDataLength, &position)];
+	}
+	return { node->DataAsElement()[node->FindChild(node->ChildDataLength, &position)], position };
+}
+
+Mimi::DocumentPositionC Mimi::TextSegmentTree::ConvertPositionToC(DocumentPositionS s)
+{
+	return { GetCharacterOffset(s, false) };
+}
+
+Mimi::DocumentPositionS Mimi::TextSegmentTree::ConvertPositionFromC(DocumentPositionC c)
+{
+	return FindCharacterOffset(c.Position, false);
+}
+
+Mimi::DocumentPositionU Mimi::TextSegmentTree::ConvertPositionToU(DocumentPositionS s)
+{
+	return { GetCharacterOffset(s, true) };
+}
+
+Mimi::DocumentPositionS Mimi::TextSegmentTree::ConvertPositionFromU(DocumentPositionU u)
+{
+	return FindCharacterOffset(u.Position, true);
+}
+
+std::size_t Mimi::TextSegmentTree::GetCharacterOffset(DocumentPositionS s, bool utf16)
+{
+	UpdateDirtyCount();
+	assert(Document->IsCharacterCountEnabled());
+	std::size_t count = s.Segment->CountCharacters(s.Position, utf16);
+
 	TextSegmentList* node = s.Segment->GetParent();
 
 	{
@@ -88,7 +270,7 @@ Mimi::DocumentPositionD Mimi::TextSegmentTree::ConvertPositionToD(DocumentPositi
 		std::size_t index = s.Segment->GetIndexInList();
 		for (std::size_t i = 0; i < index; ++i)
 		{
-			count += ptr[i]->GetCurrentLength();
+			count += ptr[i]->GetCharacterCount(utf16);
 		}
 	}
 
@@ -98,38 +280,41 @@ Mimi::DocumentPositionD Mimi::TextSegmentTree::ConvertPositionToD(DocumentPositi
 		std::size_t index = node->Index;
 		for (std::size_t i = 0; i < index; ++i)
 		{
-			count += ptr[i]->DataLength;
+			count += ptr[i]->GetCharacterCount(utf16);
 		}
 		node = node->ParentNode;
 	}
 
-	return { count };
+	return count;
 }
 
-Mimi::DocumentPositionS Mimi::TextSegmentTree::ConvertPositionFromD(DocumentPositionD d)
+Mimi::DocumentPositionS Mimi::TextSegmentTree::FindCharacterOffset(std::size_t offset, bool utf16)
 {
+	UpdateDirtyCount();
+	assert(Document->IsCharacterCountEnabled());
+	//Offsets after the end are moved to the end of the last segment.
 	TextSegmentList* node = Root;
 	std::size_t count = 0;
 	while (!node->IsLeaf)
 	{
 		TextSegmentList** ptr = node->DataAsNode();
-		while (count + (*ptr)->DataLength <= d.Position)
+		std::size_t i = 0;
+		while (i + 1 < node->ChildrenCount && count + ptr[i]->GetCharacterCount(utf16) <= offset)
 		{
-			count = count + (*ptr)->DataLength;
-			ptr += 1;
-			assert(*ptr);
+			count += ptr[i]->GetCharacterCount(utf16);
+			i += 1;
 		}
-		node = *ptr;
+		node = ptr[i];
 	}
 	{
 		TextSegment** ptr = node->DataAsElement();
-		while (count + (*ptr)->GetCurrentLength() <= d.Position)
+		std::size_t i = 0;
+		while (i + 1 < node->ChildrenCount && count + ptr[i]->GetCharacterCount(utf16) <= offset)
 		{
-			count += (*ptr)->GetCurrentLength();
-			ptr += 1;
-			assert(*ptr);
+			count += ptr[i]->GetCharacterCount(utf16);
+			i += 1;
 		}
-		return { *ptr, d.Position - count };
+		return { ptr[i], ptr[i]->FindCharacter(offset - count, utf16) };
 	}
 }
 
@@ -161,30 +346,87 @@ void Mimi::TextSegmentTree::FastAppend(TextSegment * newSegment)
 
 void Mimi::TextSegmentTree::UpdataAllCount()
 {
+	UpdateDirtyCount();
 	Root->RecursiveUpdateCount();
 }
 
-void Mimi::TextSegmentTree::CheckChildrenIndexAndCount()
+void Mimi::TextSegmentTree::MarkDirty(TextSegmentList* leaf)
 {
-	Root->CheckChildrenIndexAndCount();
+	assert(leaf->IsLeaf);
+	if (leaf->CountDirty) return;
+	leaf->CountDirty = true;
+	DirtyNodes.push_back(leaf);
+	if (FirstDirtyLeaf == nullptr || TextSegmentList::ComparePosition(leaf, FirstDirtyLeaf) < 0)
+	{
+		FirstDirtyLeaf = leaf;
+	}
+}
+
+Mimi::SnapshotNode* Mimi::TextSegmentTree::MakeSnapshotNode()
+{
+	UpdateDirtyCount();
+	return Root->GetSnapshotNode();
 }
 
-Mimi::TextSegmentList::~TextSegmentList()
+void Mimi::TextSegmentTree::ReleaseSnapshotCache(TextSegmentList* node)
 {
-	for (std::size_t i = 0; i < ChildrenCount; ++i)
+	//Children may still have a cache. Edits only release the path to the root.
+	if (node->SnapshotCache)
+	{
+		TextSegmentList::ReleaseSnapshotNode(node);
+	}
+	if (!node->IsLeaf)
 	{
-		if (IsLeaf)
+		for (std::size_t i = 0; i < node->ChildrenCount; ++i)
 		{
-			delete DataAsElement()[i];
-			DataAsElement()[i] = nullptr;
+			ReleaseSnapshotCache(node->DataAsNode()[i]);
 		}
-		else
+	}
+}
+
+void Mimi::TextSegmentTree::PropagateDirtyCount()
+{
+	//All leaves are at the same depth, so update level by level. Each node is
+	//updated once, after all of its dirty children.
+	while (!DirtyNodes.empty())
+	{
+		DirtyParents.clear();
+		for (TextSegmentList* node : DirtyNodes)
 		{
-			delete DataAsNode()[i];
-			DataAsNode()[i] = nullptr;
+			node->UpdateLocalCount();
+			node->CountDirty = false;
+			TextSegmentList* parent = node->ParentNode;
+			if (parent && !parent->CountDirty)
+			{
+				parent->CountDirty = true;
+				DirtyParents.push_back(parent);
+			}
 		}
+		DirtyNodes.swap(DirtyParents);
 	}
-	ChildrenCount = 0;
+	FirstDirtyLeaf = nullptr;
+}
+
+std::size_t Mimi::TextSegmentTree::CountNodes()
+{
+	return Root->CountNodes();
+}
+
+void Mimi::TextSegmentTree::CompactLeaf(TextSegmentList* leaf)
+{
+	assert(leaf->IsLeaf && leaf->ChildrenCount > 0);
+	//Merging may delete the leaf (and its ancestors). Keep a segment to find
+	//the node that survives.
+	TextSegment* s = leaf->DataAsElement()[0];
+	UpdateDirtyCount();
+	leaf->CheckMerge();
+	s->GetParent()->UpdateCount();
+}
+
+void Mimi::TextSegmentTree::CheckChildrenIndexAndCount()
+{
+	UpdateDirtyCount();
+	Root->CheckChildrenIndexAndCount();
 }
 
 Mimi::TextSegmentList* Mimi::TextSegmentList::Split(std::size_t pos)
@@ -193,10 +435,8 @@ Mimi::TextSegmentList* Mimi::TextSegmentList::Split(std::size_t pos)
 	if (ParentNode == nullptr)
 	{
 		//Split root
-		TextSegmentList* newRoot = new TextSegmentList();
+		TextSegmentList* newRoot = Tree->NewNode();
 		newRoot->ParentNode = nullptr;
-		newRoot->DocumentPtr = this->DocumentPtr;
-		newRoot->Tree = this->Tree;
 		newRoot->Index = 0;
 		newRoot->IsLeaf = false;
 		newRoot->ChildrenCount = 1;
@@ -204,17 +444,21 @@ Mimi::TextSegmentList* Mimi::TextSegmentList::Split(std::size_t pos)
 		newRoot->DataLength = this->DataLength;
 		newRoot->LineCount = this->LineCount;
 		newRoot->ElementCount = this->ElementCount;
+		newRoot->TailLength = this->TailLength;
+		newRoot->ChildDataLength[0] = this->DataLength;
+		newRoot->ChildLineCount[0] = this->LineCount;
+		newRoot->CodePointCount = this->CodePointCount;
+		newRoot->UTF16Count = this->UTF16Count;
 		this->ParentNode = newRoot;
 		Tree->Root = newRoot;
 	}
 
 	//Split with parent
-	TextSegmentList* newNode = new TextSegmentList();
-	newNode->DocumentPtr = this->DocumentPtr;
-	newNode->Tree = this->Tree;
+	TextSegmentList* newNode = Tree->NewNode();
 	newNode->IsLeaf = this->IsLeaf;
 	newNode->ChildrenCount = 0;
-	newNode->ElementCount = newNode->DataLength = newNode->LineCount = 0;
+	newNode->ElementCount = newNode->DataLength = newNode->LineCount = newNode->TailLength = 0;
+	newNode->CodePointCount = newNode->UTF16Count = 0;
 	MovePointers(newNode, pos, ChildrenCount - pos, 0);
 	newNode->UpdateLocalCount();
 	//newNode->UpdateChildrenIndex is delayed to caller.
@@ -237,7 +481,7 @@ void Mimi::TextSegmentList::Merge()
 	ParentNode->RemovePointer(next->Index);
 	ParentNode->UpdateChildrenIndex(Index + 1);
 	UpdateChildrenIndex(oldChildrenCount);
-	delete next;
+	Tree->DeleteNode(next);
 	ParentNode->CheckMerge();
 }
 
@@ -310,7 +554,8 @@ bool Mimi::TextSegmentList::CheckMerge()
 			{
 				//Save it to stack as this is going to be deleted.
 				TextSegmentList* p = ParentNode;
-				p->RemovePointer(Index); //Delete this.
+				p->RemovePointer(Index);
+				Tree->DeleteNode(this);
 				p->CheckMerge();
 				return false;
 			}
@@ -321,31 +566,69 @@ bool Mimi::TextSegmentList::CheckMerge()
 
 void Mimi::TextSegmentList::UpdateLocalCount()
 {
+	Tree->Version += 1;
+	ReleaseSnapshotCache();
 	if (IsLeaf)
 	{
-		std::size_t l = 0, d = 0;
+		std::size_t l = 0, d = 0, t = 0;
 		for (std::size_t i = 0; i < ChildrenCount; ++i)
 		{
-			l += DataAsElement()[i]->IsContinuous() ? 0 : 1;
-			d += DataAsElement()[i]->GetCurrentLength();
+			TextSegment* s = DataAsElement()[i];
+			std::size_t length = s->GetCurrentLength();
+			ChildDataLength[i] = static_cast<std::uint32_t>(length);
+			ChildLineCount[i] = s->IsContinuous() ? 0 : 1;
+			if (!s->IsContinuous())
+			{
+				l += 1;
+				t = 0;
+			}
+			d += length;
+			t += length;
 		}
 		LineCount = static_cast<std::uint32_t>(l);
 		DataLength = static_cast<std::uint32_t>(d);
+		TailLength = static_cast<std::uint32_t>(t);
 		ElementCount = ChildrenCount;
+		if (DocumentPtr->IsCharacterCountEnabled())
+		{
+			std::size_t c = 0, u = 0;
+			for (std::size_t i = 0; i < ChildrenCount; ++i)
+			{
+				c += DataAsElement()[i]->GetCodePointCount();
+				u += DataAsElement()[i]->GetUTF16Count();
+			}
+			CodePointCount = static_cast<std::uint32_t>(c);
+			UTF16Count = static_cast<std::uint32_t>(u);
+		}
 	}
 	else
 	{
-		std::size_t l = 0, d = 0, e = 0;
+		std::size_t l = 0, d = 0, e = 0, t = 0;
 		for (std::size_t i = 0; i < ChildrenCount; ++i)
 		{
 			TextSegmentList* node = DataAsNode()[i];
+			ChildDataLength[i] = node->DataLength;
+			ChildLineCount[i] = node->LineCount;
 			l += node->LineCount;
 			d += node->DataLength;
 			e += node->ElementCount;
+			t = node->LineCount ? node->TailLength : t + node->DataLength;
 		}
 		LineCount = static_cast<std::uint32_t>(l);
 		DataLength = static_cast<std::uint32_t>(d);
 		ElementCount = static_cast<std::uint32_t>(e);
+		TailLength = static_cast<std::uint32_t>(t);
+		if (DocumentPtr->IsCharacterCountEnabled())
+		{
+			std::size_t c = 0, u = 0;
+			for (std::size_t i = 0; i < ChildrenCount; ++i)
+			{
+				c += DataAsNode()[i]->CodePointCount;
+				u += DataAsNode()[i]->UTF16Count;
+			}
+			CodePointCount = static_cast<std::uint32_t>(c);
+			UTF16Count = static_cast<std::uint32_t>(u);
+		}
 	}
 }
 
@@ -355,7 +638,7 @@ void Mimi::TextSegmentList::UpdateChildrenIndex(std::size_t p)
 	{
 		for (std::size_t i = p; i < ChildrenCount; ++i)
 		{
-			DataAsElement()[i]->Index = static_cast<std::uint16_t>(i);
+			DataAsElement()[i]->Index = static_cast<std::uint8_t>(i);
 			DataAsElement()[i]->Parent = this;
 		}
 	}
@@ -371,48 +654,32 @@ void Mimi::TextSegmentList::UpdateChildrenIndex(std::size_t p)
 
 void Mimi::TextSegmentList::RecursiveUpdateCount()
 {
-	if (IsLeaf)
+	if (!IsLeaf)
 	{
-		std::size_t elements = 0, lines = 0, data = 0;
 		for (std::size_t i = 0; i < ChildrenCount; ++i)
 		{
-			TextSegment* s = DataAsElement()[i];
-			elements += 1;
-			lines += s->IsContinuous() ? 0 : 1;
-			data += s->GetCurrentLength();
+			DataAsNode()[i]->RecursiveUpdateCount();
 		}
-		ElementCount = static_cast<std::uint32_t>(elements);
-		LineCount = static_cast<std::uint32_t>(lines);
-		DataLength = static_cast<std::uint32_t>(data);
-	}
-	else
-	{
-		std::size_t elements = 0, lines = 0, data = 0;
-		for (std::size_t i = 0; i < ChildrenCount; ++i)
-		{
-			TextSegmentList* n = DataAsNode()[i];
-			n->RecursiveUpdateCount();
-			elements += n->ElementCount;
-			lines += n->LineCount;
-			data += n->DataLength;
-		}
-		ElementCount = static_cast<std::uint32_t>(elements);
-		LineCount = static_cast<std::uint32_t>(lines);
-		DataLength = static_cast<std::uint32_t>(data);
 	}
+	UpdateLocalCount();
 }
 
 void Mimi::TextSegmentList::InsertElement(std::size_t pos, TextSegment* element)
 {
 	assert(IsLeaf);
+	//Dirty nodes may be moved or deleted below.
+	Tree->UpdateDirtyCount();
 	CheckSplit(pos, element);
 	UpdateCount();
+	element->OnAddedToTree();
 }
 
 void Mimi::TextSegmentList::FastInsertElement(std::size_t pos, TextSegment * element)
 {
 	assert(IsLeaf);
+	Tree->UpdateDirtyCount();
 	CheckSplit(pos, element);
+	element->OnAddedToTree();
 }
 
 Mimi::TextSegment* Mimi::TextSegmentList::RemoveElement(std::size_t pos)
@@ -420,8 +687,10 @@ Mimi::TextSegment* Mimi::TextSegmentList::RemoveElement(std::size_t pos)
 	assert(IsLeaf);
 	//Don't remove the last element!
 	assert(!(ParentNode == nullptr && ChildrenCount == 1));
+	Tree->UpdateDirtyCount();
 
 	TextSegment* ret = DataAsElement()[pos];
+	ret->OnRemovedFromTree();
 	RemovePointer(pos);
 	if (CheckMerge())
 	{
@@ -431,19 +700,69 @@ Mimi::TextSegment* Mimi::TextSegmentList::RemoveElement(std::size_t pos)
 	return ret;
 }
 
+void Mimi::TextSegmentList::OnElementDataChanged(std::size_t index)
+{
+	assert(IsLeaf && index < ChildrenCount);
+	if (Tree->DeferCountDepth)
+	{
+		//Keep the length of the segment in this leaf, so that positions in the
+		//leaf can be converted without updating the counts.
+		ChildDataLength[index] = static_cast<std::uint32_t>(DataAsElement()[index]->GetCurrentLength());
+		Tree->MarkDirty(this);
+		return;
+	}
+	UpdateCount();
+}
+
+void Mimi::TextSegmentList::ReleaseSnapshotNode(TextSegmentList* n)
+{
+	n->DocumentPtr->SnapshotNodeBytes -= n->SnapshotCache->ClearRef();
+	n->SnapshotCache = nullptr;
+}
+
+Mimi::SnapshotNode* Mimi::TextSegmentList::GetSnapshotNode()
+{
+	if (SnapshotCache == nullptr)
+	{
+		SnapshotNode* node = SnapshotNode::New(IsLeaf, ChildrenCount, DataLength);
+		for (std::size_t i = 0; i < ChildrenCount; ++i)
+		{
+			if (IsLeaf)
+			{
+				StaticBufferRange range = DataAsElement()[i]->MakeSnapshotBuffer();
+				if (DocumentPtr->IsThreadSafeSnapshot())
+				{
+					range.Buffer.MakeThreadSafe();
+				}
+				node->GetRanges()[i] = range;
+			}
+			else
+			{
+				node->GetChildren()[i] = DataAsNode()[i]->GetSnapshotNode();
+			}
+		}
+		DocumentPtr->SnapshotNodeBytes += node->GetMemorySize();
+		SnapshotCache = node;
+	}
+	return SnapshotCache->NewRef();
+}
+
 void Mimi::TextSegmentList::CheckChildrenIndexAndCount()
 {
 	if (IsLeaf)
 	{
-		std::size_t elements = 0, lines = 0, data = 0;
+		std::size_t elements = 0, lines = 0, data = 0, tail = 0;
 		for (std::size_t i = 0; i < TextSegmentTreeFactor; ++i)
 		{
 			if (i < ChildrenCount)
 			{
 				TextSegment* s = DataAsElement()[i];
 				elements += 1;
+				assert(ChildDataLength[i] == s->GetCurrentLength());
+				assert(ChildLineCount[i] == (s->IsContinuous() ? 0u : 1u));
 				lines += s->IsContinuous() ? 0 : 1;
 				data += s->GetCurrentLength();
+				tail = s->IsContinuous() ? tail + s->GetCurrentLength() : s->GetCurrentLength();
 			}
 			else
 			{
@@ -453,19 +772,37 @@ void Mimi::TextSegmentList::CheckChildrenIndexAndCount()
 		assert(elements == ElementCount);
 		assert(lines == LineCount);
 		assert(data == DataLength);
+		assert(tail == TailLength);
+		if (DocumentPtr->IsCharacterCountEnabled())
+		{
+			std::size_t c = 0, u = 0;
+			for (std::size_t i = 0; i < ChildrenCount; ++i)
+			{
+				TextSegment* s = DataAsElement()[i];
+				assert(s->GetCodePointCount() == s->CountCharacters(s->GetCurrentLength(), false));
+				assert(s->GetUTF16Count() == s->CountCharacters(s->GetCurrentLength(), true));
+				c += s->GetCodePointCount();
+				u += s->GetUTF16Count();
+			}
+			assert(c == CodePointCount);
+			assert(u == UTF16Count);
+		}
 	}
 	else
 	{
-		std::size_t elements = 0, lines = 0, data = 0;
+		std::size_t elements = 0, lines = 0, data = 0, tail = 0;
 		for (std::size_t i = 0; i < TextSegmentTreeFactor; ++i)
 		{
 			if (i < ChildrenCount)
 			{
 				TextSegmentList* n = DataAsNode()[i];
 				n->CheckChildrenIndexAndCount();
+				assert(ChildDataLength[i] == n->DataLength);
+				assert(ChildLineCount[i] == n->LineCount);
 				elements += n->ElementCount;
 				lines += n->LineCount;
 				data += n->DataLength;
+				tail = n->LineCount ? n->TailLength : tail + n->DataLength;
 			}
 			else
 			{
@@ -475,5 +812,30 @@ void Mimi::TextSegmentList::CheckChildrenIndexAndCount()
 		assert(elements == ElementCount);
 		assert(lines == LineCount);
 		assert(data == DataLength);
+		assert(tail == TailLength);
+		if (DocumentPtr->IsCharacterCountEnabled())
+		{
+			std::size_t c = 0, u = 0;
+			for (std::size_t i = 0; i < ChildrenCount; ++i)
+			{
+				c += DataAsNode()[i]->CodePointCount;
+				u += DataAsNode()[i]->UTF16Count;
+			}
+			assert(c == CodePointCount);
+			assert(u == UTF16Count);
+		}
+	}
+}
+
+std::size_t Mimi::TextSegmentList::CountNodes()
+{
+	std::size_t ret = 1;
+	if (!IsLeaf)
+	{
+		for (std::size_t i = 0; i < ChildrenCount; ++i)
+		{
+			ret += DataAsNode()[i]->CountNodes();
+		}
 	}
+	return ret;
 }
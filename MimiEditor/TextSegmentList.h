@@ -4,31 +4,49 @@
 #include <cstddef>
 #include <cassert>
 #include <cstring>
+#include <vector>
 
 namespace Mimi
 {
 	const std::size_t TextSegmentTreeFactor = 64;
+	const std::size_t TextSegmentTreeCacheLine = 64;
 
 	class TextSegment;
 	class TextSegmentList;
 	class TextSegmentTree;
 	class TextDocument;
+	class TextDocumentCompactor;
+	class TextSegmentTreeFinger;
+	class SnapshotNode;
 
 	//A B-tree like list to storage TextSegments
 	class TextSegmentTree final
 	{
 		friend class TextSegmentList;
 		friend class TextDocument;
+		friend class TextDocumentCompactor;
+		friend class TextSegmentTreeFinger;
 		
 	public:
-		TextSegmentTree(TextDocument* document, TextSegment* element);
+		TextSegmentTree(TextDocument* document);
 		TextSegmentTree(const TextSegmentTree&) = delete;
 		TextSegmentTree(TextSegmentTree&&) = delete;
 		TextSegmentTree& operator= (const TextSegmentTree&) = delete;
 		~TextSegmentTree();
 
 	private:
+		TextDocument* Document;
 		TextSegmentList* Root;
+		//Changed whenever the structure or the counts of the tree change.
+		std::size_t Version;
+
+		//Deferred count update (see TextDocument::BeginTransaction). Leaves whose
+		//segments changed in length are only marked, and the counts are
+		//propagated to the root once for all of them.
+		std::size_t DeferCountDepth;
+		std::vector<TextSegmentList*> DirtyNodes;
+		std::vector<TextSegmentList*> DirtyParents;
+		TextSegmentList* FirstDirtyLeaf; //In document order.
 
 	public:
 		//Public functions, exposed by TextDocument as part of document API.
@@ -40,15 +58,44 @@ namespace Mimi
 		inline std::size_t GetElementCount();
 		inline std::size_t GetDataLength();
 
+		std::size_t GetVersion()
+		{
+			UpdateDirtyCount();
+			return Version;
+		}
+
 		TextSegment* GetSegmentWithLineIndex(std::size_t index);
+		TextSegment* GetSegmentWithElementIndex(std::size_t index);
+		std::size_t GetElementIndex(TextSegment* s);
 
 		DocumentPositionL ConvertPositionToL(DocumentPositionS s);
 		DocumentPositionS ConvertPositionFromL(DocumentPositionL i);
 		DocumentPositionD ConvertPositionToD(DocumentPositionS s);
 		DocumentPositionS ConvertPositionFromD(DocumentPositionD i);
 
+		//Code point and UTF-16 offsets. Only available when character counting is
+		//enabled (see TextDocument::SetCharacterCountEnabled).
+		inline std::size_t GetCodePointCount();
+		inline std::size_t GetUTF16Count();
+
+		DocumentPositionC ConvertPositionToC(DocumentPositionS s);
+		DocumentPositionS ConvertPositionFromC(DocumentPositionC c);
+		DocumentPositionU ConvertPositionToU(DocumentPositionS s);
+		DocumentPositionS ConvertPositionFromU(DocumentPositionU u);
+
+	private:
+		std::size_t GetCharacterOffset(DocumentPositionS s, bool utf16);
+		DocumentPositionS FindCharacterOffset(std::size_t offset, bool utf16);
+
+	private:
+		//Node allocation (from the document's arena).
+		TextSegmentList* NewNode();
+		void DeleteNode(TextSegmentList* node);
+		void DestroyAll(TextSegmentList* node);
+
 	private:
 		//Helper functions for modification
+		void InsertFirst(TextSegment* element);
 		void RemoveElement(TextSegment* e);
 
 		void InsertBefore(TextSegment* pos, TextSegment* newSegment);
@@ -62,23 +109,68 @@ namespace Mimi
 		void FastAppend(TextSegment* newSegment);
 		void UpdataAllCount();
 
+		//Deferred count update.
+		void BeginDeferCount()
+		{
+			DeferCountDepth += 1;
+		}
+
+		void EndDeferCount()
+		{
+			assert(DeferCountDepth > 0);
+			DeferCountDepth -= 1;
+			if (DeferCountDepth == 0)
+			{
+				UpdateDirtyCount();
+			}
+		}
+
+		void MarkDirty(TextSegmentList* leaf);
+		void UpdateDirtyCount()
+		{
+			if (!DirtyNodes.empty())
+			{
+				PropagateDirtyCount();
+			}
+		}
+		void PropagateDirtyCount();
+
+		//Content of the tree for a new snapshot (see SnapshotNode).
+		SnapshotNode* MakeSnapshotNode();
+		//Release all cached snapshot nodes.
+		void ReleaseSnapshotCache()
+		{
+			ReleaseSnapshotCache(Root);
+		}
+		void ReleaseSnapshotCache(TextSegmentList* node);
+
+		//Merge the leaf with its neighbour if it's underfull.
+		void CompactLeaf(TextSegmentList* leaf);
+
 	public:
 		void CheckChildrenIndexAndCount();
+		std::size_t CountNodes();
 	};
 
 	class TextSegmentList final
 	{
 		friend class TextSegmentTree;
+		friend class TextSegmentTreeFinger;
 
 	private:
 		TextSegmentList()
-			: Data() //Initialize with nullptrs
+			: DocumentPtr(nullptr), Tree(nullptr), ParentNode(nullptr), Index(0), ChildrenCount(0),
+				LineCount(0), ElementCount(0), DataLength(0), TailLength(0),
+				CodePointCount(0), UTF16Count(0), IsLeaf(true), CountDirty(false),
+				SnapshotCache(nullptr),
+				Data(), //Initialize with nullptrs
+				ChildDataLength(), ChildLineCount()
 		{
 		}
 		TextSegmentList(const TextSegmentList&) = delete;
 		TextSegmentList(TextSegmentList&&) = delete;
 		TextSegmentList& operator= (const TextSegmentList&) = delete;
-		~TextSegmentList();
+		~TextSegmentList() = default; //Children are destroyed by TextSegmentTree.
 
 	private:
 		TextDocument* DocumentPtr;
@@ -89,10 +181,26 @@ namespace Mimi
 		std::uint32_t LineCount;
 		std::uint32_t ElementCount;
 		std::uint32_t DataLength;
+		//Length of data after the last line start (all data if no line starts
+		//in this node). Used to find the offset in a line split into segments.
+		std::uint32_t TailLength;
+		//Only updated when character counting is enabled.
+		std::uint32_t CodePointCount;
+		std::uint32_t UTF16Count;
 		bool IsLeaf;
+		bool CountDirty; //In TextSegmentTree::DirtyNodes.
+		//Content of this node in the last snapshot, released when anything in the
+		//subtree changes. If a node has one, so do all of its children.
+		SnapshotNode* SnapshotCache;
 		
 		void* (Data[TextSegmentTreeFactor + 1]); //TODO ensure last is nullptr
 
+		//DataLength and LineCount of each child (for leaves, segment length and
+		//1 for line starts). Updated with the counts, so that searching reads
+		//these arrays instead of every child.
+		alignas(TextSegmentTreeCacheLine) std::uint32_t ChildDataLength[TextSegmentTreeFactor];
+		alignas(TextSegmentTreeCacheLine) std::uint32_t ChildLineCount[TextSegmentTreeFactor];
+
 	public:
 		TextSegmentList** DataAsNode()
 		{
@@ -112,18 +220,11 @@ namespace Mimi
 			return DocumentPtr;
 		}
 
-		std::size_t GetAbsLineIndex()
+		std::size_t GetCharacterCount(bool utf16)
 		{
-			if (!ParentNode) return 0;
-			std::size_t l = ParentNode->GetAbsLineIndex();
-			TextSegmentList** ptr = ParentNode->DataAsNode();
-			for (std::size_t i = 0; i < Index; ++i)
-			{
-				l += ptr[i]->LineCount;
-			}
-			return l;
+			return utf16 ? UTF16Count : CodePointCount;
 		}
-		
+
 		TextSegment* GetFirstElement()
 		{
 			TextSegmentList* n = this;
@@ -194,6 +295,32 @@ namespace Mimi
 		}
 
 	private:
+		//Sum of values of the first n children.
+		static std::size_t SumChildren(const std::uint32_t* values, std::size_t n)
+		{
+			std::size_t ret = 0;
+			for (std::size_t i = 0; i < n; ++i)
+			{
+				ret += values[i];
+			}
+			return ret;
+		}
+
+		//Find the child containing the position, which is then made relative to
+		//the child. Positions after the end are in the last child.
+		std::size_t FindChild(const std::uint32_t* values, std::size_t* position)
+		{
+			std::size_t i = 0;
+			std::size_t p = *position;
+			while (i + 1 < ChildrenCount && values[i] <= p)
+			{
+				p -= values[i];
+				i += 1;
+			}
+			*position = p;
+			return i;
+		}
+
 		static int CompareIndex(std::size_t i1, std::size_t i2)
 		{
 			if (i1 == i2) return 0;
@@ -225,6 +352,10 @@ namespace Mimi
 			assert(ChildrenCount + 1 < TextSegmentTreeFactor);
 			std::memmove(&Data[pos + 1], &Data[pos], sizeof(void*) * (ChildrenCount - pos));
 			Data[pos] = ptr;
+			Tree->Version += 1;
+			ReleaseSnapshotCache();
+			MoveChildCounts(this, pos, ChildrenCount - pos, pos + 1);
+			ChildDataLength[pos] = ChildLineCount[pos] = 0; //Set by UpdateLocalCount.
 			ChildrenCount += 1;
 		}
 
@@ -232,6 +363,9 @@ namespace Mimi
 		{
 			assert(ChildrenCount);
 			std::memmove(&Data[pos], &Data[pos + 1], sizeof(void*) * (ChildrenCount - pos - 1));
+			Tree->Version += 1;
+			ReleaseSnapshotCache();
+			MoveChildCounts(this, pos + 1, ChildrenCount - pos - 1, pos);
 			ChildrenCount -= 1;
 			Data[ChildrenCount] = nullptr;
 		}
@@ -245,13 +379,26 @@ namespace Mimi
 			std::memmove(&dest->Data[destPos + len], &dest->Data[destPos],
 				sizeof(void*) * (dest->ChildrenCount - destPos));
 			std::memcpy(&dest->Data[destPos], &Data[pos], sizeof(void*) * len);
+			Tree->Version += 1;
+			ReleaseSnapshotCache();
+			dest->ReleaseSnapshotCache();
+			dest->MoveChildCounts(dest, destPos, dest->ChildrenCount - destPos, destPos + len);
+			MoveChildCounts(dest, pos, len, destPos);
 			dest->ChildrenCount += static_cast<std::uint16_t>(len);
 
 			std::memmove(&Data[pos], &Data[pos + len], sizeof(void*) * (ChildrenCount - pos - len));
 			std::memset(&Data[ChildrenCount - len], 0, sizeof(void*) * len);
+			MoveChildCounts(this, pos + len, ChildrenCount - pos - len, pos);
 			ChildrenCount -= static_cast<std::uint16_t>(len);
 		}
 
+		//Move the child counts along with the pointers.
+		void MoveChildCounts(TextSegmentList* dest, std::size_t pos, std::size_t len, std::size_t destPos)
+		{
+			std::memmove(&dest->ChildDataLength[destPos], &ChildDataLength[pos], sizeof(std::uint32_t) * len);
+			std::memmove(&dest->ChildLineCount[destPos], &ChildLineCount[pos], sizeof(std::uint32_t) * len);
+		}
+
 		//Caller, after calling this function, must call:
 		//  returnvalue.UpdateChildrenIndex()
 		//  returnvalue.UpdateLocalCount()
@@ -282,15 +429,27 @@ namespace Mimi
 		void FastInsertElement(std::size_t pos, TextSegment* element);
 		TextSegment* RemoveElement(std::size_t pos);
 
-		void OnElementDataChanged()
+		void OnElementDataChanged(std::size_t index);
+
+		//Release the cached snapshot node of this node and its ancestors.
+		void ReleaseSnapshotCache()
 		{
-			assert(IsLeaf);
-			UpdateCount();
+			TextSegmentList* n = this;
+			while (n && n->SnapshotCache)
+			{
+				ReleaseSnapshotNode(n);
+				n = n->ParentNode;
+			}
 		}
 
+	private:
+		static void ReleaseSnapshotNode(TextSegmentList* n);
+		SnapshotNode* GetSnapshotNode();
+
 	private:
 		//For debug use only.
 		void CheckChildrenIndexAndCount();
+		std::size_t CountNodes();
 	};
 }
 
@@ -306,15 +465,30 @@ Mimi::TextSegment * Mimi::TextSegmentTree::GetLastSegment()
 
 std::size_t Mimi::TextSegmentTree::GetLineCount()
 {
+	UpdateDirtyCount();
 	return Root->LineCount;
 }
 
 std::size_t Mimi::TextSegmentTree::GetElementCount()
 {
+	UpdateDirtyCount();
 	return Root->ElementCount;
 }
 
 std::size_t Mimi::TextSegmentTree::GetDataLength()
 {
+	UpdateDirtyCount();
 	return Root->DataLength;
 }
+
+std::size_t Mimi::TextSegmentTree::GetCodePointCount()
+{
+	UpdateDirtyCount();
+	return Root->CodePointCount;
+}
+
+std::size_t Mimi::TextSegmentTree::GetUTF16Count()
+{
+	UpdateDirtyCount();
+	return Root->UTF16Count;
+}
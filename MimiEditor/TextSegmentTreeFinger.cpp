@@ -0,0 +1,172 @@
+#include "TextSegmentTreeFinger.h"
+#include "TextSegmentList.h"
+#include "TextSegment.h"
+
+Mimi::TextSegmentTreeFinger::TextSegmentTreeFinger(TextSegmentTree* tree)
+	: Tree(tree), Version(0), Depth(0)
+{
+	ElementIndex = 0;
+	ElementDataStart = ElementLineStart = 0;
+}
+
+void Mimi::TextSegmentTreeFinger::Validate()
+{
+	Tree->UpdateDirtyCount();
+	if (Depth > 0 && Version == Tree->Version) return;
+	Version = Tree->Version;
+	Depth = 1;
+	Path[0] = { Tree->Root, 0, 0 };
+	ElementIndex = 0;
+	ElementDataStart = ElementLineStart = 0;
+}
+
+bool Mimi::TextSegmentTreeFinger::Contains(std::size_t level, std::size_t key, bool line)
+{
+	if (level == 0)
+	{
+		//Including the end of the document.
+		return true;
+	}
+	PathNode& p = Path[level];
+	std::size_t start = line ? p.LineStart : p.DataStart;
+	std::size_t length = line ? p.Node->LineCount : p.Node->DataLength;
+	return key >= start && key - start < length;
+}
+
+std::size_t Mimi::TextSegmentTreeFinger::Seek(std::size_t key, bool line)
+{
+	Validate();
+	std::size_t level = Depth - 1;
+	while (!Contains(level, key, line))
+	{
+		level -= 1;
+	}
+
+	TextSegmentList* node = Path[level].Node;
+	std::size_t dataStart = Path[level].DataStart;
+	std::size_t lineStart = Path[level].LineStart;
+	std::size_t i = 0;
+	if (level == Depth - 1 && (line ? ElementLineStart : ElementDataStart) <= key)
+	{
+		//Same leaf. Continue from the last segment.
+		i = ElementIndex;
+		dataStart = ElementDataStart;
+		lineStart = ElementLineStart;
+	}
+
+	while (true)
+	{
+		while (i + 1 < node->ChildrenCount &&
+			(line ? lineStart + node->ChildLineCount[i] : dataStart + node->ChildDataLength[i]) <= key)
+		{
+			dataStart += node->ChildDataLength[i];
+			lineStart += node->ChildLineCount[i];
+			i += 1;
+		}
+		if (node->IsLeaf)
+		{
+			Depth = level + 1;
+			ElementIndex = i;
+			ElementDataStart = dataStart;
+			ElementLineStart = lineStart;
+			return i;
+		}
+		node = node->DataAsNode()[i];
+		level += 1;
+		assert(level < MaxDepth);
+		Path[level] = { node, dataStart, lineStart };
+		i = 0;
+	}
+}
+
+void Mimi::TextSegmentTreeFinger::SeekLeaf(TextSegmentList* leaf)
+{
+	TextSegmentList* nodes[MaxDepth];
+	std::size_t n = 0;
+	for (TextSegmentList* p = leaf; p; p = p->ParentNode)
+	{
+		assert(n < MaxDepth);
+		nodes[n++] = p;
+	}
+	assert(nodes[n - 1] == Tree->Root);
+
+	Path[0] = { Tree->Root, 0, 0 };
+	for (std::size_t level = 1; level < n; ++level)
+	{
+		TextSegmentList* node = nodes[n - 1 - level];
+		PathNode& parent = Path[level - 1];
+		Path[level] =
+		{
+			node,
+			parent.DataStart + TextSegmentList::SumChildren(parent.Node->ChildDataLength, node->Index),
+			parent.LineStart + TextSegmentList::SumChildren(parent.Node->ChildLineCount, node->Index),
+		};
+	}
+	Depth = n;
+	ElementIndex = 0;
+	ElementDataStart = Path[n - 1].DataStart;
+	ElementLineStart = Path[n - 1].LineStart;
+}
+
+Mimi::DocumentPositionS Mimi::TextSegmentTreeFinger::ConvertPositionFromD(DocumentPositionD d)
+{
+	assert(d.Position <= Tree->GetDataLength());
+	std::size_t i = Seek(d.Position, false);
+	return { Path[Depth - 1].Node->DataAsElement()[i], d.Position - ElementDataStart };
+}
+
+Mimi::DocumentPositionD Mimi::TextSegmentTreeFinger::ConvertPositionToD(DocumentPositionS s)
+{
+	TextSegmentList* leaf = s.Segment->GetParent();
+	Validate();
+	if (Path[Depth - 1].Node != leaf)
+	{
+		SeekLeaf(leaf);
+	}
+
+	std::size_t index = s.Segment->GetIndexInList();
+	std::size_t i = 0;
+	std::size_t dataStart = Path[Depth - 1].DataStart;
+	std::size_t lineStart = Path[Depth - 1].LineStart;
+	if (ElementIndex <= index)
+	{
+		i = ElementIndex;
+		dataStart = ElementDataStart;
+		lineStart = ElementLineStart;
+	}
+	for (; i < index; ++i)
+	{
+		dataStart += leaf->ChildDataLength[i];
+		lineStart += leaf->ChildLineCount[i];
+	}
+	ElementIndex = index;
+	ElementDataStart = dataStart;
+	ElementLineStart = lineStart;
+	return { dataStart + s.Position };
+}
+
+Mimi::TextSegment* Mimi::TextSegmentTreeFinger::GetSegmentWithLineIndex(std::size_t index)
+{
+	assert(index < Tree->GetLineCount());
+	std::size_t i = Seek(index, true);
+	return Path[Depth - 1].Node->DataAsElement()[i];
+}
+
+Mimi::DocumentPositionS Mimi::TextSegmentTreeFinger::ConvertPositionFromL(DocumentPositionL l)
+{
+	TextSegment* seg = GetSegmentWithLineIndex(l.Line);
+	if (l.Position <= seg->GetCurrentLength())
+	{
+		return { seg, l.Position };
+	}
+
+	//Position in a following continuous segment (see TextSegmentTree).
+	DocumentPositionS ret = ConvertPositionFromD({ ElementDataStart + l.Position });
+	if (ret.Position == 0)
+	{
+		ret.Segment = ret.Segment->GetPreviousSegment();
+		ret.Position = ret.Segment->GetCurrentLength();
+	}
+	assert(ret.Segment->IsContinuous());
+	return ret;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include "TextDocumentPosition.h"
+#include <cstdint>
+#include <cstddef>
+
+namespace Mimi
+{
+	class TextSegment;
+	class TextSegmentList;
+	class TextSegmentTree;
+
+	//A cursor for position conversion near the previous one (e.g. rendering or
+	//scrolling line by line). It remembers the path to the last leaf with the
+	//position of each node on it, and the last segment in the leaf. A new
+	//position is found by walking up only until the node containing it, so
+	//that sequential access is O(1) per line.
+	//The cached path is dropped when the tree changes (TextSegmentTree::GetVersion),
+	//so a finger can be kept across modifications.
+	class TextSegmentTreeFinger final
+	{
+		static const std::size_t MaxDepth = 16;
+
+		struct PathNode
+		{
+			TextSegmentList* Node;
+			std::size_t DataStart;
+			std::size_t LineStart;
+		};
+
+	public:
+		TextSegmentTreeFinger(TextSegmentTree* tree);
+
+	private:
+		TextSegmentTree* Tree;
+		std::size_t Version;
+		std::size_t Depth; //0: not positioned.
+		PathNode Path[MaxDepth]; //From the root to the leaf.
+
+		//The last segment in the leaf.
+		std::size_t ElementIndex;
+		std::size_t ElementDataStart;
+		std::size_t ElementLineStart;
+
+	public:
+		void Reset()
+		{
+			Depth = 0;
+		}
+
+		DocumentPositionS ConvertPositionFromD(DocumentPositionD d);
+		DocumentPositionD ConvertPositionToD(DocumentPositionS s);
+		TextSegment* GetSegmentWithLineIndex(std::size_t index);
+		DocumentPositionS ConvertPositionFromL(DocumentPositionL l);
+
+	private:
+		void Validate();
+		bool Contains(std::size_t level, std::size_t key, bool line);
+		std::size_t Seek(std::size_t key, bool line);
+		void SeekLeaf(TextSegmentList* leaf);
+	};
+}
@@ -0,0 +1,121 @@
+#include "TestCommon.h"
+#include "../MimiEditor/BlockCompression.h"
+#include <random>
+
+using namespace Mimi;
+
+namespace
+{
+	void RoundTrip(lest::env& lest_env, const std::vector<std::uint8_t>& data, bool compressible)
+	{
+		std::vector<std::uint8_t> compressed(data.size() * 2 + 16);
+		std::size_t size = BlockCompression::Compress(data.data(), data.size(),
+			compressed.data(), compressed.size());
+		EXPECT(size > 0u);
+		std::vector<std::uint8_t> decoded(data.size());
+		EXPECT(BlockCompression::Decompress(compressed.data(), size, decoded.data(), decoded.size()));
+		EXPECT(decoded == data);
+
+		//Wrong size is detected.
+		if (data.size() > 0)
+		{
+			EXPECT(!BlockCompression::Decompress(compressed.data(), size, decoded.data(), decoded.size() - 1));
+		}
+
+		StaticBuffer block = BlockCompression::MakeBlock(data.data(), data.size());
+		EXPECT((block.IsNull() != compressible));
+		if (!block.IsNull())
+		{
+			EXPECT(BlockCompression::GetDecodedSize(block) == data.size());
+			StaticBuffer d = BlockCompression::DecodeBlock(block);
+			EXPECT(d.GetSize() == data.size());
+			EXPECT(std::memcmp(d.GetRawData(), data.data(), data.size()) == 0);
+			d.ClearRef();
+			block.ClearRef();
+		}
+	}
+
+	std::vector<std::uint8_t> MakeText(std::size_t len)
+	{
+		const char* words[] = { "int ", "return ", "value", " = ", "0;\r\n", "\t", "if (", ") {\r\n" };
+		std::mt19937 rand(1);
+		std::vector<std::uint8_t> ret;
+		while (ret.size() < len)
+		{
+			const char* w = words[rand() % 8];
+			ret.insert(ret.end(), w, w + std::strlen(w));
+		}
+		ret.resize(len);
+		return ret;
+	}
+}
+
+DEFINE_MODULE(TestBlockCompression)
+{
+	CASE("Empty and short data")
+	{
+		RoundTrip(lest_env, {}, false);
+		RoundTrip(lest_env, { 1 }, false);
+		RoundTrip(lest_env, std::vector<std::uint8_t>(12, 'a'), false);
+		RoundTrip(lest_env, std::vector<std::uint8_t>(13, 'a'), false);
+		RoundTrip(lest_env, std::vector<std::uint8_t>(40, 'a'), true);
+	},
+	CASE("Random data")
+	{
+		std::mt19937 rand(42);
+		std::vector<std::uint8_t> data(1000);
+		for (auto&& b : data)
+		{
+			b = static_cast<std::uint8_t>(rand());
+		}
+		RoundTrip(lest_env, data, false);
+	},
+	CASE("Text")
+	{
+		RoundTrip(lest_env, MakeText(200), true);
+		RoundTrip(lest_env, MakeText(3000), true);
+		RoundTrip(lest_env, MakeText(BlockCompression::MaxBlockSize), true);
+	},
+	CASE("Long runs")
+	{
+		//Literal and match lengths over 255.
+		std::mt19937 rand(7);
+		std::vector<std::uint8_t> data;
+		for (int i = 0; i < 300; ++i)
+		{
+			data.push_back(static_cast<std::uint8_t>(rand()));
+		}
+		data.insert(data.end(), 1000, 'x');
+		for (int i = 0; i < 300; ++i)
+		{
+			data.push_back(static_cast<std::uint8_t>(rand()));
+		}
+		RoundTrip(lest_env, data, true);
+		RoundTrip(lest_env, std::vector<std::uint8_t>(BlockCompression::MaxBlockSize, 0), true);
+	},
+	CASE("Decoded block cache")
+	{
+		std::vector<StaticBuffer> blocks;
+		for (int i = 0; i < 20; ++i)
+		{
+			std::vector<std::uint8_t> data(100, static_cast<std::uint8_t>(i));
+			blocks.push_back(BlockCompression::MakeBlock(data.data(), data.size()));
+		}
+		DecodedBlockCache cache;
+		for (int j = 0; j < 3; ++j)
+		{
+			for (int i = 0; i < 20; ++i)
+			{
+				const std::uint8_t* d = cache.Get(blocks[i]);
+				EXPECT((d[0] == i && d[99] == i));
+			}
+		}
+		EXPECT(cache.GetMemorySize() == 100 * DecodedBlockCache::Capacity);
+		cache.Clear();
+		EXPECT(cache.GetMemorySize() == 0u);
+		for (auto&& b : blocks)
+		{
+			b.ClearRef();
+		}
+	},
+};
@@ -0,0 +1,187 @@
+#include "TestCommon.h"
+#include "../MimiEditor/Buffer.h"
+#include <random>
+
+using namespace Mimi;
+
+namespace
+{
+	class GapBufferTester
+	{
+	public:
+		GapBufferTester(lest::env& lest_env, std::size_t initSize)
+			: lest_env(lest_env), Buffer(initSize)
+		{
+			for (std::size_t i = 0; i < initSize; ++i)
+			{
+				std::uint8_t ch = static_cast<std::uint8_t>(i);
+				Buffer.Append(&ch, 1);
+				Items.push_back(ch);
+			}
+		}
+
+	private:
+		lest::env& lest_env;
+		DynamicBuffer Buffer;
+		std::vector<std::uint8_t> Items;
+		std::uint8_t NextValue = 0;
+
+	public:
+		void Replace(std::size_t pos, std::size_t sel, std::size_t len)
+		{
+			std::vector<std::uint8_t> data;
+			for (std::size_t i = 0; i < len; ++i)
+			{
+				data.push_back(NextValue++);
+			}
+			Buffer.GapReplace(pos, sel, data.data(), len);
+			Items.erase(Items.begin() + pos, Items.begin() + pos + sel);
+			Items.insert(Items.begin() + pos, data.begin(), data.end());
+			EXPECT(Buffer.GetLength() == Items.size());
+		}
+
+		std::size_t GetLength()
+		{
+			return Items.size();
+		}
+
+		void CheckCopy()
+		{
+			//Check both the full copy and partial copies crossing the gap.
+			StaticBuffer s = Buffer.MakeStaticBuffer();
+			EXPECT(s.GetSize() == Items.size());
+			EXPECT(std::memcmp(s.GetRawData(), Items.data(), Items.size()) == 0);
+			s.ClearRef();
+
+			std::vector<std::uint8_t> part(Items.size());
+			for (std::size_t pos = 0; pos < Items.size(); pos += 7)
+			{
+				std::size_t n = Buffer.CopyTo(part.data(), pos, 13);
+				std::size_t expected = Items.size() - pos < 13 ? Items.size() - pos : 13;
+				EXPECT(n == expected);
+				EXPECT(std::memcmp(part.data(), &Items[pos], n) == 0);
+			}
+		}
+
+		void CheckContiguous()
+		{
+			const std::uint8_t* data = Buffer.GetRawData();
+			EXPECT(!Buffer.HasGap());
+			EXPECT(std::memcmp(data, Items.data(), Items.size()) == 0);
+		}
+	};
+}
+
+DEFINE_MODULE(TestDynamicBuffer)
+{
+	CASE("Gap insert")
+	{
+		GapBufferTester t(lest_env, 100);
+		for (std::size_t i = 0; i < 50; ++i)
+		{
+			t.Replace(10 + i, 0, 1);
+		}
+		t.CheckCopy();
+		t.CheckContiguous();
+	},
+	CASE("Gap delete")
+	{
+		GapBufferTester t(lest_env, 100);
+		for (std::size_t i = 0; i < 50; ++i)
+		{
+			t.Replace(60 - i, 1, 0);
+		}
+		t.CheckCopy();
+		t.CheckContiguous();
+	},
+	CASE("Gap jump")
+	{
+		GapBufferTester t(lest_env, 100);
+		t.Replace(80, 0, 3);
+		t.Replace(5, 2, 4);
+		t.CheckCopy();
+		t.Replace(90, 10, 1);
+		t.Replace(0, 0, 2);
+		t.CheckCopy();
+		t.CheckContiguous();
+		t.Replace(t.GetLength(), 0, 5);
+		t.CheckCopy();
+	},
+	CASE("Gap random")
+	{
+		GapBufferTester t(lest_env, 1000);
+		std::mt19937 rand(42);
+		for (int i = 0; i < 2000; ++i)
+		{
+			std::size_t len = t.GetLength();
+			std::size_t pos = rand() % (len + 1);
+			std::size_t sel = rand() % 4;
+			if (sel > len - pos) sel = len - pos;
+			std::size_t ins = rand() % 5;
+			t.Replace(pos, sel, ins);
+			if (i % 100 == 0)
+			{
+				t.CheckCopy();
+			}
+		}
+		t.CheckCopy();
+		t.CheckContiguous();
+	},
+	CASE("Move")
+	{
+		DynamicBuffer a(100);
+		std::uint8_t data[] = { 1, 2, 3, 4, 5, 6 };
+		a.Append(data, 6);
+		a.GapReplace(2, 1, data, 2);
+		const std::size_t length = a.GetLength();
+
+		DynamicBuffer b(std::move(a));
+		EXPECT(a.GetLength() == 0u);
+		EXPECT(b.GetLength() == length);
+		EXPECT(b.HasGap());
+
+		//Moved-from and default buffers are empty and usable.
+		StaticBuffer s = a.MakeStaticBuffer();
+		EXPECT(s.GetSize() == 0u);
+		s.ClearRef();
+		a.GapReplace(0, 0, data, 3);
+		a.Append(data, 3);
+		EXPECT(a.GetLength() == 6u);
+
+		DynamicBuffer c;
+		c = std::move(b);
+		EXPECT(b.GetLength() == 0u);
+		s = c.MakeStaticBuffer();
+		std::uint8_t expected[] = { 1, 2, 1, 2, 4, 5, 6 };
+		EXPECT(s.GetSize() == length);
+		EXPECT(std::memcmp(s.GetRawData(), expected, length) == 0);
+		s.ClearRef();
+
+		//External buffer.
+		s = StaticBuffer::Create(data, 6);
+		DynamicBuffer d(s);
+		s.ClearRef();
+		c = std::move(d);
+		EXPECT(c.GetLength() == 6u);
+		EXPECT(std::memcmp(c.GetRawData(), data, 6) == 0);
+		b.Shink();
+		EXPECT(b.GetMemorySize() == 0u);
+	},
+	CASE("External delete")
+	{
+		std::uint8_t data[] = { 1, 2, 3, 4, 5, 6 };
+		DynamicBuffer d(6);
+		d.Append(data, 6);
+		StaticBuffer s = d.MakeStaticBuffer();
+		DynamicBuffer a(s);
+		a.GapReplace(0, 2, nullptr, 0);
+		DynamicBuffer b(s);
+		b.Delete(1, 3);
+		s.ClearRef();
+		EXPECT(a.GetLength() == 4u);
+		EXPECT(std::memcmp(a.GetRawData(), &data[2], 4) == 0);
+		std::uint8_t expected[] = { 1, 5, 6 };
+		EXPECT(b.GetLength() == 3u);
+		EXPECT(std::memcmp(b.GetRawData(), expected, 3) == 0);
+	},
+};
@@ -0,0 +1,38 @@
+#include "TestCommon.h"
+#include "../MimiEditor/FileTypeDetector.h"
+#include "../MimiEditor/TextDocument.h"
+#include <memory>
+#include <random>
+
+using namespace Mimi;
+using ReaderHandle = std::unique_ptr<IFileReader>;
+using DocumentHandle = std::unique_ptr<TextDocument>;
+
+//Line conversion on files with long lines (e.g. minified code), which are
+//split into many continuous segments.
+void TestLongLineSpeed(const char* path)
+{
+	IFile* file = IFile::CreateFromPath(String::FromUtf8Ptr(path));
+	ReaderHandle r = ReaderHandle(file->Read());
+	FileTypeDetector detector(std::move(r), {});
+	DocumentHandle doc = DocumentHandle(TextDocument::CreateFromTextFile(&detector));
+	TextSegmentTree& tree = doc->SegmentTree;
+
+	const int Repeat = 1000000;
+	std::mt19937 rand(1);
+	std::size_t length = tree.GetDataLength();
+	std::size_t check = 0;
+
+	Clock clock;
+	for (int i = 0; i < Repeat; ++i)
+	{
+		DocumentPositionS s = tree.ConvertPositionFromD({ rand() % length });
+		DocumentPositionL l = tree.ConvertPositionToL(s);
+		DocumentPositionS s2 = tree.ConvertPositionFromL(l);
+		check += s2.Position;
+	}
+	double time = clock.GetElapsedMilliSecond<double>();
+
+	std::cout << "Lines:" << tree.GetLineCount() << " Segments:" << tree.GetElementCount() << std::endl;
+	std::cout << "Time:" << time << " ms (" << check << ")" << std::endl;
+}
@@ -6,10 +6,16 @@ MODULE_LIST(AllTests,
 	TestEncodingString,
 	TestEncodingDetection,
 	TestLineSeparation,
-	TestSegmentListModification);
+	TestSegmentListModification,
+	TestDynamicBuffer,
+	TestStaticBuffer,
+	TestBlockCompression,
+	TestShortVector);
 
 //TODO Organize other test functions.
 void TestReadLargeFile(const char* path);
+void TestLongLineSpeed(const char* path);
+void TestTreeLookupSpeed(std::size_t lines);
 void TestGDIWindow();
 
 const char* ExecutableDirectory;
@@ -96,6 +102,18 @@ int main(int argc, char** argv)
 		return 0;
 	}
 
+	if (auto p = args.Has1("--TestLongLineSpeed"))
+	{
+		TestLongLineSpeed(p[0]);
+		return 0;
+	}
+
+	if (auto p = args.Has1("--TestTreeLookupSpeed"))
+	{
+		TestTreeLookupSpeed(std::strtoul(p[0], nullptr, 10));
+		return 0;
+	}
+
 	if (args.Has0("--TestGDIWindow"))
 	{
 		TestGDIWindow();
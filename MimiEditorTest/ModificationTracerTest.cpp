@@ -67,6 +67,27 @@ namespace
 				}
 				vectorPosition += 1;
 			}
+			CheckSortedConversion();
+		}
+
+		//All positions in one pass, with mixed directions.
+		void CheckSortedConversion()
+		{
+			std::vector<std::size_t> pos;
+			std::vector<int> dir;
+			for (int i = 0; i < InitialSize; ++i)
+			{
+				for (int d = -1; d <= 1; ++d)
+				{
+					pos.push_back(i);
+					dir.push_back(d);
+				}
+			}
+			Tracer.ConvertFromSnapshotSorted(0, pos.data(), dir.data(), pos.size());
+			for (std::size_t i = 0; i < pos.size(); ++i)
+			{
+				EXPECT(pos[i] == Tracer.ConvertFromSnapshot(0, i / 3, dir[i]));
+			}
 		}
 
 		void Split(int pos, ModificationTester& other)
@@ -153,6 +174,15 @@ DEFINE_MODULE(TestModificationTracer)
 		t.Delete(2, 2);
 		t.CheckConversion();
 	},
+	CASE("Empty changes")
+	{
+		ModificationTester t(lest_env, 6);
+		t.Delete(2, 0);
+		t.Insert(3, 0);
+		t.Insert(4, 1);
+		t.Delete(1, 2);
+		t.CheckConversion();
+	},
 	CASE("Insertion after deletion")
 	{
 		ModificationTester t(lest_env, 4);
@@ -3,6 +3,15 @@
 #include "../MimiEditor/TextDocument.h"
 #include "../MimiEditor/Snapshot.h"
 #include "../MimiEditor/SnapshotReader.h"
+#include "../MimiEditor/SnapshotPositionConverter.h"
+#include "../MimiEditor/SnapshotDiff.h"
+#include "../MimiEditor/TextDocumentCompactor.h"
+#include "../MimiEditor/TextSegmentTreeFinger.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
 
 using namespace Mimi;
 
@@ -11,11 +20,14 @@ namespace
 	class LineModificationTester
 	{
 	public:
-		LineModificationTester(lest::env& lest_env)
+		//Each line is lineLength chars, including the line break.
+		LineModificationTester(lest::env& lest_env, std::size_t lineLength = 3)
 			: lest_env(lest_env),
 				Doc(TextDocument::CreateEmpty(CodePageManager::UTF16LE)),
+				LineLength(lineLength),
 				LineBuffer(10)
 		{
+			assert(lineLength >= 3);
 		}
 
 		~LineModificationTester()
@@ -26,6 +38,7 @@ namespace
 	private:
 		lest::env& lest_env;
 		TextDocument* const Doc;
+		const std::size_t LineLength;
 		std::vector<int> Lines;
 		int NextLineId = 0;
 		DynamicBuffer LineBuffer;
@@ -41,6 +54,10 @@ namespace
 			LineBuffer.Clear();
 			assert(id + 128 < 0xD800);
 			AppendChar(static_cast<char16_t>(id + 128));
+			for (std::size_t i = 3; i < LineLength; ++i)
+			{
+				AppendChar(' ');
+			}
 			AppendChar('\r');
 			AppendChar('\n');
 			return LineBuffer;
@@ -48,10 +65,14 @@ namespace
 
 	public:
 		void Append()
+		{
+			Append(NextLineId++);
+		}
+
+		void Append(int id)
 		{
 			TextSegment* s = Doc->SegmentTree.GetLastSegment();
 			assert(s->GetCurrentLength() == 0);
-			int id = NextLineId++;
 			Lines.push_back(id);
 			Doc->Insert(Doc->GetTime(), { s, 0 }, MakeBuffer(id), true, 0, 0);
 			Doc->SegmentTree.CheckChildrenIndexAndCount();
@@ -78,6 +99,84 @@ namespace
 			Doc->SegmentTree.CheckChildrenIndexAndCount();
 		}
 
+		//Change the id of a line without changing the segments.
+		void Replace(std::size_t pos)
+		{
+			int id = NextLineId++;
+			Lines[pos] = id;
+			DocumentPositionS s = Doc->SegmentTree.ConvertPositionFromL({ pos, 0 });
+			Doc->DeleteRange(Doc->GetTime(), { s.Segment, 0 }, { s.Segment, 2 });
+			LineBuffer.Clear();
+			AppendChar(static_cast<char16_t>(id + 128));
+			Doc->Insert(Doc->GetTime(), { s.Segment, 0 }, LineBuffer, false, 0, 0);
+			Doc->SegmentTree.CheckChildrenIndexAndCount();
+		}
+
+		void Compact()
+		{
+			TextDocumentCompactor c(Doc);
+			std::size_t slices = 1;
+			while (!c.Run(Doc->GetTime() + 1, 0))
+			{
+				slices += 1;
+			}
+			EXPECT(slices > 1);
+			Doc->SegmentTree.CheckChildrenIndexAndCount();
+
+			TextSegment* s = Doc->SegmentTree.GetFirstSegment();
+			bool inactive = true;
+			while (s)
+			{
+				inactive = inactive && !s->IsActive();
+				s = s->GetNextSegment();
+			}
+			EXPECT(inactive);
+			CheckMemory();
+		}
+
+		void CompactCompressed()
+		{
+			Doc->SetCompressionEnabled(true);
+			TextDocumentCompactor c(Doc);
+			while (!c.Run(Doc->GetTime() + 1, 0))
+			{
+			}
+			DocumentMemoryUsage m = Doc->GetMemoryUsage();
+			EXPECT(m.CompressedSegmentCount > 0u);
+			EXPECT(m.CompressedContentBytes < m.CompressedContentLength);
+			CheckMemory();
+		}
+
+		void CompactInline()
+		{
+			TextDocumentCompactor c(Doc);
+			while (!c.Run(Doc->GetTime() + 1, 0))
+			{
+			}
+			//Including the last (empty) segment.
+			DocumentMemoryUsage m = Doc->GetMemoryUsage();
+			EXPECT(m.InlineSegmentCount == Lines.size() + 1);
+			EXPECT(m.InlineContentLength == Lines.size() * LineLength * 2);
+			EXPECT(m.InactiveContentBytes == 0u);
+			CheckMemory();
+		}
+
+		void CompactDeduplicated(std::size_t uniqueLines)
+		{
+			Doc->SetDeduplicationEnabled(true);
+			TextDocumentCompactor c(Doc);
+			while (!c.Run(Doc->GetTime() + 1, 0))
+			{
+			}
+			DocumentMemoryUsage m = Doc->GetMemoryUsage();
+			//All but the last (empty) segment.
+			EXPECT(m.InternedSegmentCount == Lines.size());
+			EXPECT(m.InternedContentLength == Lines.size() * LineLength * 2);
+			EXPECT(m.InternedContentBytes == uniqueLines * LineLength * 2);
+			EXPECT(m.GetDedupRatio() == static_cast<double>(Lines.size()) / uniqueLines);
+			CheckMemory();
+		}
+
 	private:
 		void CheckConnectivity()
 		{
@@ -102,24 +201,806 @@ namespace
 		void CheckData()
 		{
 			std::unique_ptr<Snapshot> snapshot = std::unique_ptr<Snapshot>(Doc->CreateSnapshot());
-			SnapshotReader r(snapshot.get());
-			char16_t buffer[3];
+			EXPECT(Doc->GetMemoryUsage().SnapshotBytes == SnapshotReader(snapshot.get()).GetSize());
+			CheckMemory();
+			CheckSnapshot(snapshot.get(), Lines);
+		}
+
+		void CheckSnapshot(Snapshot* snapshot, const std::vector<int>& lines)
+		{
+			SnapshotReader r(snapshot);
+			std::vector<char16_t> buffer(LineLength);
 			std::size_t checkRead;
 			std::size_t vectorIndex = 0;
 			while (r.GetPosition() < r.GetSize())
 			{
-				int id = Lines[vectorIndex++];
-				bool suc = r.Read(reinterpret_cast<mchar8_t*>(buffer), 6, &checkRead);
-				EXPECT((vectorIndex <= Lines.size()) && suc && checkRead == 6 && buffer[0] == id + 128);
+				int id = lines[vectorIndex++];
+				bool suc = r.Read(reinterpret_cast<mchar8_t*>(buffer.data()), LineLength * 2, &checkRead);
+				EXPECT((vectorIndex <= lines.size()) && suc && checkRead == LineLength * 2 && buffer[0] == id + 128);
+			}
+			EXPECT(vectorIndex == lines.size());
+		}
+
+		void CheckMemory()
+		{
+			DocumentMemoryUsage m1 = Doc->GetMemoryUsage();
+			DocumentMemoryUsage m2 = Doc->CollectMemoryUsage();
+			EXPECT(m1.SegmentCount == m2.SegmentCount);
+			EXPECT(m1.NodeCount == m2.NodeCount);
+			EXPECT(m1.ActiveSegmentCount == m2.ActiveSegmentCount);
+			EXPECT(m1.InactiveSegmentCount == m2.InactiveSegmentCount);
+			EXPECT(m1.InactiveContentBytes == m2.InactiveContentBytes);
+			EXPECT(m1.ActiveContentCapacity == m2.ActiveContentCapacity);
+			EXPECT(m1.ActiveContentLength == m2.ActiveContentLength);
+			EXPECT(m1.TracerBytes == m2.TracerBytes);
+			EXPECT(m1.LabelBytes == m2.LabelBytes);
+			EXPECT(m1.CompressedSegmentCount == m2.CompressedSegmentCount);
+			EXPECT(m1.CompressedContentBytes == m2.CompressedContentBytes);
+			EXPECT(m1.CompressedContentLength == m2.CompressedContentLength);
+			EXPECT(m1.InternedSegmentCount == m2.InternedSegmentCount);
+			EXPECT(m1.InternedContentLength == m2.InternedContentLength);
+			EXPECT(m1.InlineSegmentCount == m2.InlineSegmentCount);
+			EXPECT(m1.InlineContentLength == m2.InlineContentLength);
+			EXPECT(m1.ActiveContentLength + m1.InactiveContentBytes + m1.CompressedContentLength +
+				m1.InternedContentLength + m1.InlineContentLength == Doc->SegmentTree.GetDataLength());
+		}
+
+	public:
+		//Snapshots share the nodes not changed in between.
+		void CheckSharedSnapshot()
+		{
+			std::unique_ptr<Snapshot> s1 = std::unique_ptr<Snapshot>(Doc->CreateSnapshot());
+			std::size_t bytes1 = Doc->GetMemoryUsage().SnapshotNodeBytes;
+			std::vector<int> lines1 = Lines;
+			Insert(Lines.size() / 2);
+			Delete(Lines.size() / 3);
+			std::unique_ptr<Snapshot> s2 = std::unique_ptr<Snapshot>(Doc->CreateSnapshot());
+			std::size_t bytes2 = Doc->GetMemoryUsage().SnapshotNodeBytes;
+			EXPECT(bytes2 - bytes1 < bytes1 / 10);
+			CheckSnapshot(s1.get(), lines1);
+			CheckSnapshot(s2.get(), Lines);
+
+			//Old nodes only used by s1 are released. Others are kept by the tree.
+			s1.reset();
+			std::size_t bytes3 = Doc->GetMemoryUsage().SnapshotNodeBytes;
+			EXPECT(bytes3 < bytes2);
+			s2.reset();
+			EXPECT(Doc->GetMemoryUsage().SnapshotBytes == 0);
+			EXPECT(Doc->GetMemoryUsage().SnapshotNodeBytes == bytes3);
+
+			//Nodes changed after the last snapshot are released.
+			Delete(0);
+			EXPECT(Doc->GetMemoryUsage().SnapshotNodeBytes < bytes3);
+		}
+
+		//Random access with Seek, Skip and GetChunkAt.
+		void CheckSeek()
+		{
+			std::unique_ptr<Snapshot> snapshot(Doc->CreateSnapshot());
+			const std::vector<int>& lines = Lines;
+			SnapshotReader r(snapshot.get());
+			std::size_t lineBytes = LineLength * 2;
+			EXPECT(r.GetSize() == lines.size() * lineBytes);
+			char16_t c;
+			std::size_t checkRead;
+			std::size_t line = 0;
+			for (std::size_t i = 0; i < lines.size(); ++i)
+			{
+				line = (line + 7919) % lines.size();
+				EXPECT(r.Seek(line * lineBytes));
+				EXPECT(r.GetPosition() == line * lineBytes);
+				EXPECT((r.Read(reinterpret_cast<mchar8_t*>(&c), 2, &checkRead) && checkRead == 2));
+				EXPECT(c == lines[line] + 128);
+
+				//Skip to the next line.
+				if (line + 1 < lines.size())
+				{
+					EXPECT(r.Skip(lineBytes - 2));
+					EXPECT((r.Read(reinterpret_cast<mchar8_t*>(&c), 2, &checkRead) && checkRead == 2));
+					EXPECT(c == lines[line + 1] + 128);
+				}
+
+				std::size_t length;
+				const std::uint8_t* data = r.GetChunkAt(line * lineBytes, &length);
+				EXPECT(length <= r.GetSize() - line * lineBytes);
+				EXPECT((length >= 2 && (data[0] | data[1] << 8) == lines[line] + 128));
+			}
+
+			EXPECT(r.Seek(r.GetSize()));
+			EXPECT((r.Read(reinterpret_cast<mchar8_t*>(&c), 2, &checkRead) && checkRead == 0));
+			EXPECT(!r.Seek(r.GetSize() + 1));
+			EXPECT(r.GetPosition() == r.GetSize());
+			EXPECT(r.Seek(0));
+			EXPECT(!r.Skip(r.GetSize() + 1));
+			EXPECT(r.GetPosition() == r.GetSize());
+		}
+
+		//Workers read snapshots while this thread keeps editing, and release
+		//them with QueueDispose.
+		void CheckThreads(std::size_t workerCount, std::size_t snapshotCount)
+		{
+			struct Job
+			{
+				Snapshot* Content;
+				std::vector<int> Lines;
+			};
+			std::mutex lock;
+			std::condition_variable cv;
+			std::deque<Job> jobs;
+			bool finished = false;
+			std::atomic<std::size_t> checked(0), errors(0);
+			const std::size_t lineLength = LineLength;
+
+			auto worker = [&]()
+			{
+				while (true)
+				{
+					Job job;
+					{
+						std::unique_lock<std::mutex> l(lock);
+						cv.wait(l, [&]() { return finished || !jobs.empty(); });
+						if (jobs.empty()) return;
+						job = std::move(jobs.front());
+						jobs.pop_front();
+					}
+					if (!CheckLines(job.Content, job.Lines, lineLength))
+					{
+						errors += 1;
+					}
+					job.Content->QueueDispose();
+					checked += 1;
+				}
+			};
+
+			Doc->SetThreadSafeSnapshot(true);
+			std::vector<std::thread> threads;
+			for (std::size_t i = 0; i < workerCount; ++i)
+			{
+				threads.emplace_back(worker);
+			}
+			std::size_t pos = 0;
+			for (std::size_t i = 0; i < snapshotCount; ++i)
+			{
+				for (std::size_t j = 0; j < 5; ++j)
+				{
+					pos = (pos + 7919) % Lines.size();
+					Replace(pos);
+				}
+				Insert(pos);
+				Job job = { Doc->CreateSnapshot(), Lines };
+				{
+					std::lock_guard<std::mutex> l(lock);
+					jobs.push_back(std::move(job));
+				}
+				cv.notify_one();
+				if (i % 8 == 0)
+				{
+					Doc->DisposeQueuedSnapshots();
+				}
+			}
+			{
+				std::lock_guard<std::mutex> l(lock);
+				finished = true;
+			}
+			cv.notify_all();
+			for (auto&& t : threads)
+			{
+				t.join();
+			}
+			Doc->DisposeQueuedSnapshots();
+			EXPECT(checked == snapshotCount);
+			EXPECT(errors == 0u);
+			EXPECT(Doc->GetSnapshotCount() == 0u);
+			Doc->SetThreadSafeSnapshot(false);
+		}
+
+		//Snapshot nodes cached before thread-safe snapshots are enabled must
+		//not be reused, including those under an edited node.
+		void CheckThreadSafeSnapshot()
+		{
+			std::unique_ptr<Snapshot> before(Doc->CreateSnapshot());
+			Replace(Lines.size() / 2);
+			Doc->SetThreadSafeSnapshot(true);
+			std::unique_ptr<Snapshot> after(Doc->CreateSnapshot());
+			EXPECT(after->CheckThreadSafe());
+			Doc->SetThreadSafeSnapshot(false);
+		}
+
+		//Convert a position in each line of a snapshot (after the first char,
+		//which Replace changes) while the document is edited.
+		void CheckConverter()
+		{
+			const std::size_t removed = static_cast<std::size_t>(-1);
+			std::unique_ptr<Snapshot> snapshot(Doc->CreateSnapshot());
+			SnapshotPositionConverter converter(snapshot.get());
+			std::size_t lineBytes = LineLength * 2;
+			std::size_t oldLineCount = Lines.size();
+			//Line index in the snapshot of each line.
+			std::vector<std::size_t> origin;
+			for (std::size_t i = 0; i < Lines.size(); ++i)
+			{
+				origin.push_back(i);
+			}
+
+			std::size_t pos = 0;
+			for (std::size_t i = 0; i < 200; ++i)
+			{
+				pos = (pos + 7919) % Lines.size();
+				if (i % 2)
+				{
+					Insert(pos);
+					origin.insert(origin.begin() + pos, removed);
+				}
+				else
+				{
+					Replace(pos);
+				}
+				if (i % 50 != 49) continue;
+
+				for (std::size_t line = 0; line < origin.size(); ++line)
+				{
+					if (origin[line] == removed) continue;
+					DocumentPositionS s = converter.Convert(origin[line] * lineBytes + 2, 0);
+					DocumentPositionL l = Doc->SegmentTree.ConvertPositionToL(s);
+					EXPECT((l.Line == line && l.Position == 2));
+				}
+				DocumentPositionS end = converter.Convert(oldLineCount * lineBytes, -1);
+				EXPECT(Doc->SegmentTree.ConvertPositionToD(end).Position == Lines.size() * lineBytes);
+
+				//Batch conversion, including deleted chars (replaced).
+				std::vector<std::size_t> positions;
+				std::vector<int> dirs;
+				for (std::size_t p = 0; p <= oldLineCount * lineBytes; p += 3)
+				{
+					positions.push_back(p);
+					dirs.push_back(static_cast<int>(p % 3) - 1);
+				}
+				std::vector<DocumentPositionS> results(positions.size());
+				converter.Convert(positions.data(), dirs.data(), positions.size(), results.data());
+				for (std::size_t j = 0; j < positions.size(); ++j)
+				{
+					DocumentPositionS r = converter.Convert(positions[j], dirs[j]);
+					EXPECT((results[j].Segment == r.Segment && results[j].Position == r.Position));
+				}
+			}
+		}
+
+		//Diff of snapshots taken between random edits. With delete, history of
+		//the removed segment is lost and the whole document should be returned
+		//for snapshots created before it.
+		void CheckDiff(bool withDelete)
+		{
+			std::vector<std::unique_ptr<Snapshot>> snapshots;
+			snapshots.emplace_back(Doc->CreateSnapshot());
+			std::size_t pos = 0;
+			for (std::size_t i = 0; i < 3; ++i)
+			{
+				for (std::size_t j = 0; j < 20; ++j)
+				{
+					pos = (pos + 7919) % Lines.size();
+					if (j % 2) Insert(pos);
+					else Replace(pos);
+				}
+				if (withDelete && i == 1) Delete(Lines.size() - 1);
+				snapshots.emplace_back(Doc->CreateSnapshot());
+			}
+			for (std::size_t i = 0; i < snapshots.size(); ++i)
+			{
+				for (std::size_t j = i + 1; j < snapshots.size(); ++j)
+				{
+					SnapshotDiff diff(snapshots[i].get(), snapshots[j].get());
+					CheckDiff(snapshots[i].get(), snapshots[j].get(), diff.GetChanges());
+					bool full = diff.GetChanges().size() == 1 && diff.GetChanges()[0].OldPosition == 0 &&
+						diff.GetChanges()[0].OldLength == ReadAll(snapshots[i].get()).size();
+					EXPECT((full == (withDelete && i < 2)));
+				}
+			}
+		}
+
+	private:
+		static std::vector<std::uint8_t> ReadAll(Snapshot* snapshot)
+		{
+			SnapshotReader r(snapshot);
+			std::vector<std::uint8_t> ret(r.GetSize());
+			std::size_t n = 0;
+			r.Read(ret.data(), ret.size(), &n);
+			assert(n == ret.size());
+			return ret;
+		}
+
+		//Text outside the changes must be the same.
+		void CheckDiff(Snapshot* a, Snapshot* b, const std::vector<SnapshotChange>& changes)
+		{
+			std::vector<std::uint8_t> da = ReadAll(a), db = ReadAll(b);
+			std::size_t pa = 0, pb = 0;
+			for (auto&& c : changes)
+			{
+				EXPECT((c.OldPosition >= pa && c.NewPosition >= pb));
+				EXPECT(c.OldPosition - pa == c.NewPosition - pb);
+				EXPECT(std::equal(da.begin() + pa, da.begin() + c.OldPosition, db.begin() + pb));
+				EXPECT((c.OldLength > 0 || c.NewLength > 0));
+				pa = c.OldPosition + c.OldLength;
+				pb = c.NewPosition + c.NewLength;
 			}
-			EXPECT(vectorIndex == Lines.size());
+			EXPECT(da.size() - pa == db.size() - pb);
+			EXPECT(std::equal(da.begin() + pa, da.end(), db.begin() + pb));
+		}
+
+	private:
+		//Called by workers (without EXPECT).
+		static bool CheckLines(Snapshot* snapshot, const std::vector<int>& lines, std::size_t lineLength)
+		{
+			SnapshotLineIterator it(snapshot);
+			for (std::size_t i = 0; i < lines.size(); ++i)
+			{
+				if (!it.MoveNext() || it.GetLength() != lineLength * 2) return false;
+				const std::uint8_t* data = it.GetData();
+				if ((data[0] | data[1] << 8) != lines[i] + 128) return false;
+			}
+			//The last (empty) line.
+			while (it.MoveNext())
+			{
+				if (it.GetLength() != 0) return false;
+			}
+			return SnapshotReader(snapshot).GetSize() == lines.size() * lineLength * 2;
 		}
 
 	public:
+		//Deactivation only visits active segments.
+		void CheckDeactivate()
+		{
+			for (std::size_t i = 0; i < Lines.size(); i += 10)
+			{
+				Replace(i);
+			}
+			std::size_t active = Doc->GetMemoryUsage().ActiveSegmentCount;
+			EXPECT(active > 0);
+			CheckMemory();
+
+			//Not while a snapshot is in use.
+			Snapshot* s = Doc->CreateSnapshot();
+			EXPECT(Doc->DeactivateSegments(Doc->GetTime() + 1) == 0);
+			delete s;
+
+			//Not modified since time 0, as the document is just created.
+			EXPECT(Doc->DeactivateSegments(0) == 0);
+			EXPECT(Doc->DeactivateSegments(Doc->GetTime() + 1) == active);
+			EXPECT(Doc->GetMemoryUsage().ActiveSegmentCount == 0);
+			CheckMemory();
+		}
+
+		//Tracers of segments not used after a snapshot is created are updated
+		//lazily. Check the length of each segment in the snapshots.
+		//Note that lines are not deleted, as tracers of removed segments are
+		//not kept.
+		void CheckTracer()
+		{
+			std::unique_ptr<Snapshot> s1 = std::unique_ptr<Snapshot>(Doc->CreateSnapshot());
+			std::vector<int> lines1 = Lines;
+			Replace(10);
+			Insert(20);
+			std::unique_ptr<Snapshot> s2 = std::unique_ptr<Snapshot>(Doc->CreateSnapshot());
+			std::vector<int> lines2 = Lines;
+			Insert(30);
+			Insert(10);
+			std::unique_ptr<Snapshot> s3 = std::unique_ptr<Snapshot>(Doc->CreateSnapshot());
+			std::vector<int> lines3 = Lines;
+			Replace(21);
+			Insert(22);
+			CheckHistory(s1.get(), 2);
+			CheckHistory(s2.get(), 1);
+			CheckHistory(s3.get(), 0);
+
+			//Dispose the middle one first (not removed from the tracers).
+			s2.reset();
+			Insert(40);
+			CheckHistory(s1.get(), 2);
+			CheckHistory(s3.get(), 0);
+			s1.reset();
+			Replace(5);
+			std::unique_ptr<Snapshot> s4 = std::unique_ptr<Snapshot>(Doc->CreateSnapshot());
+			Insert(5);
+			Replace(40);
+			CheckHistory(s3.get(), 1);
+			CheckHistory(s4.get(), 0);
+			CheckSnapshot(s3.get(), lines3);
+		}
+
+		//Tracers grow when used during a burst of snapshots, and shrink back
+		//when the snapshots are disposed.
+		void CheckTracerCapacity()
+		{
+			for (std::size_t i = 0; i < 80; i += 10)
+			{
+				Replace(i);
+			}
+			std::vector<std::unique_ptr<Snapshot>> snapshots;
+			for (std::size_t i = 0; i < 8; ++i)
+			{
+				snapshots.emplace_back(Doc->CreateSnapshot());
+				Replace(i * 10);
+			}
+			EXPECT(Doc->GetSnapshotCapacity() == 8);
+			std::size_t bytes = Doc->GetMemoryUsage().TracerBytes;
+			CheckMemory();
+			CheckHistory(snapshots[0].get(), 7);
+			CheckHistory(snapshots[7].get(), 0);
+
+			snapshots.erase(snapshots.begin(), snapshots.begin() + 6);
+			EXPECT(Doc->GetSnapshotCapacity() == 4);
+			snapshots.erase(snapshots.begin());
+			EXPECT(Doc->GetSnapshotCapacity() == 2);
+			EXPECT(Doc->GetMemoryUsage().TracerBytes < bytes);
+			CheckMemory();
+			Replace(0);
+			CheckHistory(snapshots[0].get(), 0);
+		}
+
+		//sid: number of snapshots created after it.
+		void CheckHistory(Snapshot* snapshot, std::size_t sid)
+		{
+			std::size_t length = 0;
+			for (TextSegment* s = Doc->SegmentTree.GetFirstSegment(); s; s = s->GetNextSegment())
+			{
+				length += s->GetHistoryLength(sid);
+			}
+			EXPECT(length == SnapshotReader(snapshot).GetSize());
+		}
+
 		void CheckList()
 		{
 			CheckConnectivity();
+			CheckMemory();
 			CheckData();
+			CheckMemory();
+			EXPECT(Doc->GetMemoryUsage().SnapshotBytes == 0);
+		}
+
+		//Disposing the newer snapshot keeps the older one in use.
+		void CheckDisposeSnapshot()
+		{
+			std::unique_ptr<Snapshot> a(Doc->CreateSnapshot());
+			std::unique_ptr<Snapshot> b(Doc->CreateSnapshot());
+			b.reset();
+			EXPECT(Doc->GetSnapshotCount() == 2u);
+			a.reset();
+			EXPECT(Doc->GetSnapshotCount() == 0u);
+			Insert(0);
+			CheckList();
+		}
+	};
+
+	//A document with characters of different lengths, and the byte offset of each
+	//character to check character offset conversion.
+	class CharacterCountTester
+	{
+	public:
+		CharacterCountTester(lest::env& lest_env, CodePage cp)
+			: lest_env(lest_env), Doc(TextDocument::CreateEmpty(cp)), UTF8(cp == CodePageManager::UTF8)
+		{
+			Doc->SetCharacterCountEnabled(true);
+		}
+
+		~CharacterCountTester()
+		{
+			delete Doc;
+		}
+
+	private:
+		lest::env& lest_env;
+		TextDocument* const Doc;
+		const bool UTF8;
+		//Code points of each line, including the line break.
+		std::vector<std::vector<char32_t>> Lines;
+
+	private:
+		void Encode(char32_t c, DynamicBuffer& buffer)
+		{
+			if (UTF8)
+			{
+				mchar8_t data[4];
+				buffer.Append(data, CodePageManager::UTF8.CharFromUTF32(c, data));
+			}
+			else
+			{
+				char16_t data[2];
+				std::size_t n = UnicodeHelper::ConvertUTF32To16(c, data);
+				buffer.Append(reinterpret_cast<std::uint8_t*>(data), n * 2);
+			}
+		}
+
+		std::size_t GetByteLength(char32_t c)
+		{
+			if (UTF8)
+			{
+				return c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+			}
+			return c < 0x10000 ? 2 : 4;
+		}
+
+	public:
+		void Insert(std::size_t line, int id)
+		{
+			const char32_t chars[] = { 'a', 0xE9, 0x4E2D, 0x1F600 };
+			std::vector<char32_t> text;
+			for (int i = 0; i < id % 7; ++i)
+			{
+				text.push_back(chars[(id + i) % 4]);
+			}
+			text.push_back('\n');
+			DynamicBuffer buffer(10);
+			for (char32_t c : text)
+			{
+				Encode(c, buffer);
+			}
+			Lines.insert(Lines.begin() + line, text);
+			DocumentPositionS pos = Doc->SegmentTree.ConvertPositionFromL({ line, 0 });
+			Doc->Insert(Doc->GetTime(), pos, buffer, true, 0, 0);
+			Doc->SegmentTree.CheckChildrenIndexAndCount();
+		}
+
+		void Delete(std::size_t line, std::size_t count)
+		{
+			Lines.erase(Lines.begin() + line, Lines.begin() + line + count);
+			DocumentPositionS begin = Doc->SegmentTree.ConvertPositionFromL({ line, 0 });
+			DocumentPositionS end = Doc->SegmentTree.ConvertPositionFromL({ line + count, 0 });
+			Doc->DeleteRange(Doc->GetTime(), begin, end);
+			Doc->SegmentTree.CheckChildrenIndexAndCount();
+		}
+
+		void Compact()
+		{
+			Doc->SetCompressionEnabled(true);
+			TextDocumentCompactor c(Doc);
+			while (!c.Run(Doc->GetTime() + 1, 0))
+			{
+			}
+			Doc->SegmentTree.CheckChildrenIndexAndCount();
+		}
+
+		void Check()
+		{
+			TextSegmentTree& tree = Doc->SegmentTree;
+			std::size_t d = 0, c = 0, u = 0;
+			for (auto&& line : Lines)
+			{
+				for (char32_t ch : line)
+				{
+					DocumentPositionS s = tree.ConvertPositionFromD({ d });
+					EXPECT(tree.ConvertPositionToC(s).Position == c);
+					EXPECT(tree.ConvertPositionToU(s).Position == u);
+					EXPECT(tree.ConvertPositionToD(tree.ConvertPositionFromC({ c })).Position == d);
+					EXPECT(tree.ConvertPositionToD(tree.ConvertPositionFromU({ u })).Position == d);
+					if (ch >= 0x10000)
+					{
+						//Inside the surrogate pair.
+						EXPECT(tree.ConvertPositionToD(tree.ConvertPositionFromU({ u + 1 })).Position == d);
+					}
+					d += GetByteLength(ch);
+					c += 1;
+					u += ch >= 0x10000 ? 2 : 1;
+				}
+			}
+			EXPECT(tree.GetDataLength() == d);
+			EXPECT(tree.GetCodePointCount() == c);
+			EXPECT(tree.GetUTF16Count() == u);
+			EXPECT(tree.ConvertPositionToD(tree.ConvertPositionFromC({ c })).Position == d);
+			EXPECT(tree.ConvertPositionToD(tree.ConvertPositionFromU({ u + 10 })).Position == d);
+		}
+	};
+
+	//Lines longer than a segment, which are split into continuous segments.
+	class LongLineTester
+	{
+	public:
+		LongLineTester(lest::env& lest_env)
+			: lest_env(lest_env), Doc(TextDocument::CreateEmpty(CodePageManager::UTF8)),
+				Finger(&Doc->SegmentTree)
+		{
+		}
+
+		~LongLineTester()
+		{
+			delete Doc;
+		}
+
+	private:
+		lest::env& lest_env;
+		TextDocument* const Doc;
+		//Kept across modifications.
+		TextSegmentTreeFinger Finger;
+		//Length of each line, including the line break.
+		std::vector<std::size_t> Lines;
+
+	public:
+		//Insert a line of (chunks * chunkLength + 1) bytes.
+		void Insert(std::size_t line, std::size_t chunks, std::size_t chunkLength)
+		{
+			DynamicBuffer buffer(chunkLength + 1);
+			std::vector<std::uint8_t> data(chunkLength, 'a' + line % 26);
+			buffer.Append(data.data(), chunkLength);
+			buffer.Append(reinterpret_cast<const std::uint8_t*>("\n"), 1);
+			Doc->Insert(Doc->GetTime(), Doc->SegmentTree.ConvertPositionFromL({ line, 0 }),
+				buffer, true, 0, 0);
+			buffer.Clear();
+			buffer.Append(data.data(), chunkLength);
+			for (std::size_t i = 1; i < chunks; ++i)
+			{
+				Doc->Insert(Doc->GetTime(), Doc->SegmentTree.ConvertPositionFromL({ line, 0 }),
+					buffer, false, 0, 0);
+			}
+			Lines.insert(Lines.begin() + line, chunks * chunkLength + 1);
+			Doc->SegmentTree.CheckChildrenIndexAndCount();
+		}
+
+		void Delete(std::size_t line)
+		{
+			DocumentPositionS begin = Doc->SegmentTree.ConvertPositionFromL({ line, 0 });
+			DocumentPositionS end = Doc->SegmentTree.ConvertPositionFromL({ line + 1, 0 });
+			Doc->DeleteRange(Doc->GetTime(), begin, end);
+			Lines.erase(Lines.begin() + line);
+			Doc->SegmentTree.CheckChildrenIndexAndCount();
+		}
+
+		//Insert length bytes at the beginning of each line in a transaction.
+		void InsertInTransaction(const std::vector<std::size_t>& lines, std::size_t length)
+		{
+			std::vector<TextSegment*> segments;
+			for (std::size_t line : lines)
+			{
+				segments.push_back(Doc->SegmentTree.GetSegmentWithLineIndex(line));
+			}
+			std::vector<std::uint8_t> data(length, '#');
+			DynamicBuffer buffer(length);
+			std::size_t totalLength = Doc->SegmentTree.GetDataLength();
+
+			Doc->BeginTransaction();
+			for (std::size_t i = 0; i < lines.size(); ++i)
+			{
+				buffer.Clear();
+				buffer.Append(data.data(), length);
+				Doc->Insert(Doc->GetTime(), { segments[i], 0 }, buffer, false, 0, 0);
+				Lines[lines[i]] += length;
+				totalLength += length;
+				if (i == lines.size() / 2)
+				{
+					//Queries in the transaction.
+					EXPECT(Doc->SegmentTree.GetDataLength() == totalLength);
+					EXPECT(Finger.GetSegmentWithLineIndex(lines[i]) == segments[i]);
+				}
+			}
+			Doc->CommitTransaction();
+			Doc->SegmentTree.CheckChildrenIndexAndCount();
+		}
+
+		void Check()
+		{
+			TextSegmentTree& tree = Doc->SegmentTree;
+			EXPECT(tree.GetLineCount() == Lines.size() + 1);
+			EXPECT(tree.GetElementCount() > tree.GetLineCount());
+
+			//Each segment.
+			std::size_t line = 0;
+			TextSegment* s = tree.GetFirstSegment();
+			s = s->GetNextSegment();
+			while (s)
+			{
+				line += s->IsContinuous() ? 0 : 1;
+				EXPECT(s->GetLineIndex() == line);
+				EXPECT(tree.GetSegmentWithLineIndex(line)->GetLineIndex() == line);
+				s = s->GetNextSegment();
+			}
+
+			//Positions in each line.
+			std::size_t d = 0;
+			for (std::size_t i = 0; i < Lines.size(); ++i)
+			{
+				for (std::size_t pos = 0; pos < Lines[i]; pos += 997)
+				{
+					DocumentPositionL l = tree.ConvertPositionToL(tree.ConvertPositionFromD({ d + pos }));
+					EXPECT((l.Line == i && l.Position == pos));
+					EXPECT(tree.ConvertPositionToD(tree.ConvertPositionFromL({ i, pos })).Position == d + pos);
+				}
+				//End of line (before the line break) is in the same line.
+				DocumentPositionS end = tree.ConvertPositionFromL({ i, Lines[i] - 1 });
+				EXPECT(end.Segment->GetLineIndex() == i);
+				EXPECT(tree.ConvertPositionToD(end).Position == d + Lines[i] - 1);
+				d += Lines[i];
+			}
+			DocumentPositionL l = tree.ConvertPositionToL(tree.ConvertPositionFromD({ d }));
+			EXPECT((l.Line == Lines.size() && l.Position == 0));
+		}
+
+		//Chunks and lines of a snapshot, compared with SnapshotReader.
+		void CheckIterators()
+		{
+			std::unique_ptr<Snapshot> snapshot(Doc->CreateSnapshot());
+			SnapshotReader r(snapshot.get());
+			std::vector<std::uint8_t> data(r.GetSize());
+			std::size_t checkRead;
+			EXPECT((r.Read(data.data(), data.size(), &checkRead) && checkRead == data.size()));
+
+			SnapshotChunkIterator chunks(snapshot.get());
+			std::size_t chunkCount = 0;
+			std::size_t position = 0;
+			while (chunks.MoveNext())
+			{
+				EXPECT(chunks.GetPosition() == position);
+				EXPECT(std::equal(chunks.GetData(), chunks.GetData() + chunks.GetLength(), &data[position]));
+				position += chunks.GetLength();
+				chunkCount += 1;
+			}
+			EXPECT(position == data.size());
+			EXPECT(chunkCount == Doc->SegmentTree.GetElementCount());
+
+			//The last line is empty.
+			SnapshotLineIterator lines(snapshot.get());
+			position = 0;
+			for (std::size_t i = 0; i <= Lines.size(); ++i)
+			{
+				EXPECT(lines.MoveNext());
+				EXPECT(lines.GetLineIndex() == i);
+				EXPECT(lines.GetPosition() == position);
+				EXPECT(lines.GetLength() == (i < Lines.size() ? Lines[i] : 0));
+				EXPECT(std::equal(lines.GetData(), lines.GetData() + lines.GetLength(), &data[position]));
+				position += lines.GetLength();
+			}
+			EXPECT(!lines.MoveNext());
+			EXPECT(position == data.size());
+		}
+
+		void CompactCompressed()
+		{
+			Doc->SetCompressionEnabled(true);
+			TextDocumentCompactor c(Doc);
+			while (!c.Run(Doc->GetTime() + 1, 0))
+			{
+			}
+			EXPECT(Doc->GetMemoryUsage().CompressedSegmentCount > 0);
+		}
+
+		void CheckFinger()
+		{
+			TextSegmentTree& tree = Doc->SegmentTree;
+
+			//Forward, backward and random, by line.
+			std::size_t lineCount = tree.GetLineCount();
+			std::vector<std::size_t> order;
+			for (std::size_t i = 0; i < lineCount; ++i)
+			{
+				order.push_back(i);
+			}
+			for (std::size_t i = lineCount; i-- > 0;)
+			{
+				order.push_back(i);
+			}
+			for (std::size_t i = 0; i < lineCount; ++i)
+			{
+				order.push_back(i * 7919 % lineCount);
+			}
+			for (std::size_t line : order)
+			{
+				TextSegment* s = tree.GetSegmentWithLineIndex(line);
+				EXPECT(Finger.GetSegmentWithLineIndex(line) == s);
+				EXPECT(Finger.ConvertPositionToD({ s, 1 }).Position == tree.ConvertPositionToD({ s, 1 }).Position);
+				if (line < Lines.size())
+				{
+					DocumentPositionS p1 = tree.ConvertPositionFromL({ line, Lines[line] - 1 });
+					DocumentPositionS p2 = Finger.ConvertPositionFromL({ line, Lines[line] - 1 });
+					EXPECT((p1.Segment == p2.Segment && p1.Position == p2.Position));
+				}
+			}
+
+			//By data position, including the end.
+			std::size_t length = tree.GetDataLength();
+			for (std::size_t d = 0; d <= length; d += 101)
+			{
+				DocumentPositionS p1 = tree.ConvertPositionFromD({ d });
+				DocumentPositionS p2 = Finger.ConvertPositionFromD({ d });
+				EXPECT((p1.Segment == p2.Segment && p1.Position == p2.Position));
+			}
+			DocumentPositionS end = Finger.ConvertPositionFromD({ length });
+			EXPECT((end.Segment == tree.GetLastSegment() && end.Position == end.Segment->GetCurrentLength()));
 		}
 	};
 }
@@ -135,6 +1016,15 @@ DEFINE_MODULE(TestSegmentListModification)
 		}
 		t.CheckList();
 	},
+	CASE("Dispose snapshot")
+	{
+		LineModificationTester t(lest_env);
+		for (int i = 0; i < 100; ++i)
+		{
+			t.Append();
+		}
+		t.CheckDisposeSnapshot();
+	},
 	CASE("Insert forward")
 	{
 		LineModificationTester t(lest_env);
@@ -252,4 +1142,280 @@ DEFINE_MODULE(TestSegmentListModification)
 		}
 		t.CheckList();
 	},
+	CASE("Compact")
+	{
+		LineModificationTester t(lest_env);
+		for (int i = 0; i < 200; ++i)
+		{
+			t.Append();
+		}
+		int pos = 0;
+		for (int i = 0; i < 5000; ++i)
+		{
+			pos = (pos + 23456789) % (200 + i);
+			t.Insert(pos);
+		}
+		for (int i = 0; i < 4000; ++i)
+		{
+			pos = (pos + 23456789) % (5200 - i);
+			t.Delete(pos);
+		}
+		t.Compact();
+		t.CheckList();
+	},
+	CASE("Compress")
+	{
+		LineModificationTester t(lest_env, 20);
+		for (int i = 0; i < 3000; ++i)
+		{
+			t.Append();
+		}
+		t.CompactCompressed();
+		t.CheckList();
+		int pos = 0;
+		for (int i = 0; i < 500; ++i)
+		{
+			pos = (pos + 23456789) % (3000 + i);
+			t.Insert(pos);
+		}
+		for (int i = 0; i < 500; ++i)
+		{
+			pos = (pos + 23456789) % (3500 - i);
+			t.Delete(pos);
+		}
+		t.CheckList();
+		t.CompactCompressed();
+		t.CheckList();
+	},
+	CASE("Deduplicate")
+	{
+		LineModificationTester t(lest_env, 20);
+		for (int i = 0; i < 2000; ++i)
+		{
+			t.Append(i % 10);
+		}
+		t.CompactDeduplicated(10);
+		t.CheckList();
+		for (int i = 0; i < 10; ++i)
+		{
+			t.Delete(i * 100);
+		}
+		t.CheckList();
+		t.CompactDeduplicated(10);
+		t.CheckList();
+	},
+	CASE("Character count")
+	{
+		CodePage cps[] = { CodePageManager::UTF8, CodePageManager::UTF16LE };
+		for (CodePage cp : cps)
+		{
+			CharacterCountTester t(lest_env, cp);
+			for (int i = 0; i < 2000; ++i)
+			{
+				t.Insert(i, i);
+			}
+			t.Check();
+			int pos = 0;
+			for (int i = 0; i < 100; ++i)
+			{
+				pos = (pos + 23456789) % (2000 + i);
+				t.Insert(pos, i);
+			}
+			for (int i = 0; i < 20; ++i)
+			{
+				pos = (pos + 23456789) % (2000 - i * 5);
+				t.Delete(pos, 5);
+			}
+			t.Check();
+			t.Compact();
+			t.Check();
+			t.Insert(1000, 3);
+			t.Delete(10, 3);
+			t.Check();
+		}
+	},
+	CASE("Long lines")
+	{
+		LongLineTester t(lest_env);
+		for (std::size_t i = 0; i < 200; ++i)
+		{
+			t.Insert(i, i % 10 == 0 ? 5 : 1, i % 10 == 0 ? 30000 : 50);
+		}
+		t.Check();
+		for (std::size_t i = 0; i < 20; ++i)
+		{
+			t.Insert(i * 7, 3, 40000);
+			t.Delete(i * 9 + 1);
+		}
+		t.Check();
+		t.CheckIterators();
+		t.CompactCompressed();
+		t.CheckIterators();
+	},
+	CASE("Finger")
+	{
+		LongLineTester t(lest_env);
+		t.CheckFinger();
+		for (std::size_t i = 0; i < 2000; ++i)
+		{
+			t.Insert(i, i % 100 == 0 ? 3 : 1, i % 100 == 0 ? 30000 : 20);
+		}
+		t.CheckFinger();
+		for (std::size_t i = 0; i < 20; ++i)
+		{
+			t.Insert(i * 70, 1, 10);
+			t.Delete(i * 90 + 1);
+			if (i % 5 == 0)
+			{
+				t.CheckFinger();
+			}
+		}
+		t.CheckFinger();
+	},
+	CASE("Shared snapshot")
+	{
+		LineModificationTester t(lest_env);
+		for (int i = 0; i < 10000; ++i)
+		{
+			t.Append();
+		}
+		t.CheckSharedSnapshot();
+		t.CheckList();
+		t.Compact();
+		t.CheckSharedSnapshot();
+		t.CheckList();
+	},
+	CASE("Tracer")
+	{
+		LineModificationTester t(lest_env);
+		for (int i = 0; i < 100; ++i)
+		{
+			t.Append();
+		}
+		t.CheckTracer();
+		t.CheckList();
+		t.Compact();
+		t.CheckTracer();
+		t.CheckList();
+		t.CheckTracerCapacity();
+		t.CheckList();
+	},
+	CASE("Seek")
+	{
+		LineModificationTester t(lest_env, 20);
+		for (int i = 0; i < 3000; ++i)
+		{
+			t.Append();
+		}
+		int pos = 0;
+		for (int i = 0; i < 500; ++i)
+		{
+			pos = (pos + 23456789) % (3000 + i);
+			t.Insert(pos);
+		}
+		t.CheckSeek();
+		t.CompactCompressed();
+		t.CheckSeek();
+		t.CheckList();
+	},
+	CASE("Position converter")
+	{
+		LineModificationTester t(lest_env, 20);
+		for (int i = 0; i < 3000; ++i)
+		{
+			t.Append();
+		}
+		t.CheckConverter();
+		t.CheckList();
+		t.Compact();
+		t.CheckConverter();
+		t.CheckList();
+	},
+	CASE("Snapshot diff")
+	{
+		LineModificationTester t(lest_env, 20);
+		for (int i = 0; i < 1000; ++i)
+		{
+			t.Append();
+		}
+		t.CheckDiff(false);
+		t.Compact();
+		t.CheckDiff(false);
+		t.CheckDiff(true);
+		t.CheckList();
+	},
+	CASE("Threads")
+	{
+		LineModificationTester t(lest_env, 20);
+		for (int i = 0; i < 3000; ++i)
+		{
+			t.Append();
+		}
+		t.CompactCompressed();
+		t.CheckThreads(8, 200);
+		t.CheckList();
+	},
+	CASE("Thread-safe snapshot")
+	{
+		LineModificationTester t(lest_env, 20);
+		for (int i = 0; i < 5000; ++i)
+		{
+			t.Append();
+		}
+		t.CheckThreadSafeSnapshot();
+		t.CheckList();
+		t.Compact();
+		t.CheckThreadSafeSnapshot();
+		t.CheckList();
+	},
+	CASE("Deactivate")
+	{
+		LineModificationTester t(lest_env);
+		for (int i = 0; i < 1000; ++i)
+		{
+			t.Append();
+		}
+		t.Compact();
+		t.CheckDeactivate();
+		t.CheckList();
+	},
+	CASE("Transaction")
+	{
+		LongLineTester t(lest_env);
+		for (std::size_t i = 0; i < 3000; ++i)
+		{
+			t.Insert(i, i % 100 == 0 ? 3 : 1, i % 100 == 0 ? 30000 : 20);
+		}
+		std::vector<std::size_t> lines;
+		for (std::size_t i = 0; i < 3000; i += 7)
+		{
+			lines.push_back(2999 - i);
+		}
+		t.InsertInTransaction(lines, 3);
+		t.Check();
+		std::reverse(lines.begin(), lines.end());
+		t.InsertInTransaction(lines, 5);
+		t.Check();
+		t.CheckFinger();
+	},
+	CASE("Inline")
+	{
+		LineModificationTester t(lest_env);
+		for (int i = 0; i < 1000; ++i)
+		{
+			t.Append();
+		}
+		t.CompactInline();
+		//Moved to heap by the snapshot, and back by the compactor.
+		t.CheckList();
+		t.CompactInline();
+		for (int i = 0; i < 10; ++i)
+		{
+			t.Delete(i * 50);
+			t.Insert(i * 70);
+		}
+		t.CheckList();
+		t.CompactInline();
+		t.CheckList();
+	},
 };
@@ -0,0 +1,90 @@
+#include "TestCommon.h"
+#include "../MimiEditor/ShortVector.h"
+#include <utility>
+
+using namespace Mimi;
+
+namespace
+{
+	struct Item
+	{
+		std::uint16_t A;
+		std::uint16_t B;
+		std::uint16_t C;
+	};
+
+	template <typename V>
+	bool CheckItems(V& v, std::size_t count)
+	{
+		if (v.GetCount() != count) return false;
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			if (v[i].A != i || v[i].C != i * 2) return false;
+		}
+		return true;
+	}
+
+	template <typename V>
+	void AppendItems(V& v, std::size_t count)
+	{
+		for (std::size_t i = v.GetCount(); i < count; ++i)
+		{
+			v.Append({ static_cast<std::uint16_t>(i), 0, static_cast<std::uint16_t>(i * 2) });
+		}
+	}
+}
+
+DEFINE_MODULE(TestShortVector)
+{
+	CASE("Inline storage")
+	{
+		ShortVector<Item, 2> v;
+		EXPECT(sizeof(v) == 16u);
+		EXPECT(v.GetCapacity() == 2u);
+		AppendItems(v, 2);
+		EXPECT(v.GetHeapSize() == 0u);
+		EXPECT(CheckItems(v, 2));
+
+		AppendItems(v, 5);
+		EXPECT(v.GetHeapSize() > 0u);
+		EXPECT(CheckItems(v, 5));
+
+		v.RemoveRange(2, 3);
+		v.Shink();
+		EXPECT(v.GetHeapSize() == 0u);
+		EXPECT(CheckItems(v, 2));
+	},
+	CASE("No inline storage")
+	{
+		ShortVector<Item> v;
+		EXPECT(v.GetPointer() == nullptr);
+		AppendItems(v, 100);
+		EXPECT(CheckItems(v, 100));
+		v.Clear();
+		v.Shink(0);
+		EXPECT(v.GetPointer() == nullptr);
+		EXPECT(v.GetHeapSize() == 0u);
+	},
+	CASE("Move")
+	{
+		ShortVector<Item, 2> a, b;
+		AppendItems(a, 1);
+		b = std::move(a);
+		EXPECT(a.GetCount() == 0u);
+		EXPECT(CheckItems(b, 1));
+
+		AppendItems(a, 10);
+		Item* p = a.GetPointer();
+		b = std::move(a);
+		EXPECT(b.GetPointer() == p);
+		EXPECT(CheckItems(b, 10));
+		EXPECT(a.GetCount() == 0u);
+		EXPECT(a.GetHeapSize() == 0u);
+
+		ShortVector<Item, 2> c(std::move(b));
+		EXPECT(CheckItems(c, 10));
+		EXPECT(b.GetCount() == 0u);
+		AppendItems(b, 3);
+		EXPECT(CheckItems(b, 3));
+	},
+};
@@ -0,0 +1,119 @@
+#include "TestCommon.h"
+#include "../MimiEditor/Buffer.h"
+#include "../MimiEditor/BufferInternTable.h"
+#include <thread>
+
+using namespace Mimi;
+
+namespace
+{
+	StaticBuffer MakeBuffer(std::size_t size)
+	{
+		DynamicBuffer b(size);
+		for (std::size_t i = 0; i < size; ++i)
+		{
+			std::uint8_t ch = static_cast<std::uint8_t>(i);
+			b.Append(&ch, 1);
+		}
+		return b.MakeStaticBuffer();
+	}
+
+	bool CheckBuffer(StaticBuffer b, std::size_t size)
+	{
+		if (b.GetSize() != size) return false;
+		for (std::size_t i = 0; i < size; ++i)
+		{
+			if (b.GetRawData()[i] != static_cast<std::uint8_t>(i)) return false;
+		}
+		return true;
+	}
+}
+
+DEFINE_MODULE(TestStaticBuffer)
+{
+	CASE("Empty buffer")
+	{
+		StaticBuffer b = StaticBuffer::CreateEmpty();
+		EXPECT(!b.IsNull());
+		EXPECT(b.GetSize() == 0);
+		b.ClearRef();
+		EXPECT(b.IsNull());
+	},
+	CASE("Many references")
+	{
+		//More than a 16-bit counter can hold.
+		StaticBuffer b = MakeBuffer(100);
+		std::vector<StaticBuffer> refs;
+		for (std::size_t i = 0; i < 70000; ++i)
+		{
+			refs.push_back(b.NewRef());
+		}
+		b.ClearRef();
+		for (std::size_t i = 1; i < refs.size(); ++i)
+		{
+			refs[i].ClearRef();
+		}
+		EXPECT(CheckBuffer(refs[0], 100));
+		refs[0].ClearRef();
+	},
+	CASE("Thread-safe references")
+	{
+		StaticBuffer b = MakeBuffer(100);
+		EXPECT(!b.IsThreadSafe());
+		b.MakeThreadSafe();
+		EXPECT(b.IsThreadSafe());
+
+		std::vector<std::thread> threads;
+		std::vector<int> results(4, 0);
+		for (int t = 0; t < 4; ++t)
+		{
+			StaticBuffer r = b.NewRef();
+			threads.emplace_back([r, t, &results]() mutable
+			{
+				bool ok = true;
+				for (int i = 0; i < 10000; ++i)
+				{
+					StaticBuffer r2 = r.NewRef();
+					ok = ok && CheckBuffer(r2, 100);
+					r2.ClearRef();
+				}
+				r.ClearRef();
+				results[t] = ok ? 1 : 0;
+			});
+		}
+		for (std::size_t i = 0; i < 10000; ++i)
+		{
+			b.NewRef().ClearRef();
+		}
+		for (auto&& t : threads)
+		{
+			t.join();
+		}
+		EXPECT(std::count(results.begin(), results.end(), 1) == 4);
+		EXPECT(CheckBuffer(b, 100));
+		b.ClearRef();
+	},
+	CASE("Intern table")
+	{
+		BufferInternTable table;
+		std::uint8_t a[] = "separator";
+		std::uint8_t c[] = "separatoR";
+		StaticBuffer b1 = table.Intern(StaticBuffer::Create(a, 9));
+		StaticBuffer b2 = table.Intern(StaticBuffer::Create(a, 9));
+		StaticBuffer b3 = table.Intern(StaticBuffer::Create(c, 9));
+		EXPECT(b1.GetRawData() == b2.GetRawData());
+		EXPECT(b1.GetRawData() != b3.GetRawData());
+		EXPECT(table.GetCount() == 2u);
+		EXPECT(table.GetContentBytes() == 18u);
+
+		b1.ClearRef();
+		b3.ClearRef();
+		table.Purge();
+		EXPECT(table.GetCount() == 1u);
+		EXPECT(table.GetContentBytes() == 9u);
+		EXPECT(!b2.IsUnique());
+		b2.ClearRef();
+		table.Purge();
+		EXPECT(table.GetCount() == 0u);
+	},
+};
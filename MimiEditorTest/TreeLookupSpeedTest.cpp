@@ -0,0 +1,106 @@
+#include "TestCommon.h"
+#include "../MimiEditor/TextDocument.h"
+#include "../MimiEditor/TextSegmentTreeFinger.h"
+#include <memory>
+#include <random>
+#include <vector>
+
+using namespace Mimi;
+using DocumentHandle = std::unique_ptr<TextDocument>;
+
+//Descending the segment tree by byte offset and line index, in a document
+//with the given number of lines (e.g. 1000000 or 100000000).
+void TestTreeLookupSpeed(std::size_t lines)
+{
+	DocumentHandle doc = DocumentHandle(TextDocument::CreateEmpty(CodePageManager::UTF8));
+	TextSegmentTree& tree = doc->SegmentTree;
+	std::mt19937 rand(1);
+
+	Clock loadClock;
+	DynamicBuffer buffer(20);
+	for (std::size_t i = 0; i < lines; ++i)
+	{
+		buffer.Clear();
+		std::size_t len = rand() % 16;
+		for (std::size_t j = 0; j < len; ++j)
+		{
+			buffer.Append(reinterpret_cast<const std::uint8_t*>("x"), 1);
+		}
+		buffer.Append(reinterpret_cast<const std::uint8_t*>("\n"), 1);
+		doc->Insert(0, { tree.GetLastSegment(), 0 }, buffer, true, nullptr, nullptr);
+	}
+	double loadTime = loadClock.GetElapsedMilliSecond<double>();
+
+	const int Repeat = 10000000;
+	std::size_t length = tree.GetDataLength();
+	std::size_t lineCount = tree.GetLineCount();
+	std::size_t check = 0;
+
+	Clock dataClock;
+	for (int i = 0; i < Repeat; ++i)
+	{
+		check += tree.ConvertPositionFromD({ rand() % length }).Position;
+	}
+	double dataTime = dataClock.GetElapsedMilliSecond<double>();
+
+	//Segments are not read here, only the tree.
+	Clock lineClock;
+	for (int i = 0; i < Repeat; ++i)
+	{
+		check += reinterpret_cast<std::uintptr_t>(tree.GetSegmentWithLineIndex(rand() % lineCount)) & 0xFF;
+	}
+	double lineTime = lineClock.GetElapsedMilliSecond<double>();
+
+	//Scrolling through all lines.
+	Clock scrollClock;
+	for (std::size_t i = 0; i < lineCount; ++i)
+	{
+		check += reinterpret_cast<std::uintptr_t>(tree.GetSegmentWithLineIndex(i)) & 0xFF;
+	}
+	double scrollTime = scrollClock.GetElapsedMilliSecond<double>();
+
+	TextSegmentTreeFinger finger(&tree);
+	Clock fingerClock;
+	for (std::size_t i = 0; i < lineCount; ++i)
+	{
+		check += reinterpret_cast<std::uintptr_t>(finger.GetSegmentWithLineIndex(i)) & 0xFF;
+	}
+	double fingerTime = fingerClock.GetElapsedMilliSecond<double>();
+
+	//Typing with a cursor on each line, from the end to the beginning.
+	std::vector<TextSegment*> cursors;
+	for (std::size_t i = lineCount - 1; i-- > 0;)
+	{
+		cursors.push_back(tree.GetSegmentWithLineIndex(i));
+	}
+	buffer.Clear();
+	buffer.Append(reinterpret_cast<const std::uint8_t*>("x"), 1);
+	//Activate the segments first (not included in the time).
+	for (TextSegment* s : cursors)
+	{
+		doc->Insert(0, { s, 0 }, buffer, false, nullptr, nullptr);
+	}
+	Clock editClock;
+	for (TextSegment* s : cursors)
+	{
+		doc->Insert(0, { s, 0 }, buffer, false, nullptr, nullptr);
+	}
+	double editTime = editClock.GetElapsedMilliSecond<double>();
+	Clock transactionClock;
+	doc->BeginTransaction();
+	for (TextSegment* s : cursors)
+	{
+		doc->Insert(0, { s, 0 }, buffer, false, nullptr, nullptr);
+	}
+	doc->CommitTransaction();
+	double transactionTime = transactionClock.GetElapsedMilliSecond<double>();
+
+	std::cout << "Lines:" << lineCount << " Nodes:" << tree.CountNodes() <<
+		" Load:" << loadTime << " ms (" << check << ")" << std::endl;
+	std::cout << "ConvertPositionFromD:" << dataTime * 1000000 / Repeat << " ns" << std::endl;
+	std::cout << "GetSegmentWithLineIndex:" << lineTime * 1000000 / Repeat << " ns" << std::endl;
+	std::cout << "Scroll (tree):" << scrollTime * 1000000 / lineCount << " ns/line" << std::endl;
+	std::cout << "Scroll (finger):" << fingerTime * 1000000 / lineCount << " ns/line" << std::endl;
+	std::cout << "Edit (" << cursors.size() << " cursors):" << editTime << " ms" << std::endl;
+	std::cout << "Edit (" << cursors.size() << " cursors, transaction):" << transactionTime << " ms" << std::endl;
+}